@@ -15,11 +15,20 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := applypatch.c bspatch.c freecache.c imgpatch.c utils.c
+# LZ4 chunks in image patches are only understood when the tree has
+# liblz4; see lz4chunk.h.
+applypatch_lz4 := $(wildcard external/lz4/lib/lz4.h)
+
+LOCAL_SRC_FILES := applypatch.c bspatch.c freecache.c imgpatch.c utils.c lz4chunk.c
 LOCAL_MODULE := libapplypatch
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += external/bzip2 external/zlib bootable/recovery
 LOCAL_STATIC_LIBRARIES += libmtdutils libmincrypt libbz libz
+ifneq ($(applypatch_lz4),)
+LOCAL_CFLAGS += -DUSE_LZ4
+LOCAL_C_INCLUDES += external/lz4/lib
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
 
 include $(BUILD_STATIC_LIBRARY)
 
@@ -30,6 +39,9 @@ LOCAL_MODULE := applypatch
 LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf
 LOCAL_SHARED_LIBRARIES += libz libcutils libstdc++ libc
+ifneq ($(applypatch_lz4),)
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
 
 include $(BUILD_EXECUTABLE)
 
@@ -42,15 +54,24 @@ LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf
 LOCAL_STATIC_LIBRARIES += libz libcutils libstdc++ libc
+ifneq ($(applypatch_lz4),)
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
 
 include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := imgdiff.c utils.c bsdiff.c
+LOCAL_SRC_FILES := imgdiff.c utils.c bsdiff.c lz4chunk.c
 LOCAL_MODULE := imgdiff
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_C_INCLUDES += external/zlib external/bzip2
-LOCAL_STATIC_LIBRARIES += libz libbz
+LOCAL_STATIC_LIBRARIES += libz libbz libmincrypt
+ifneq ($(applypatch_lz4),)
+LOCAL_CFLAGS += -DUSE_LZ4
+LOCAL_C_INCLUDES += external/lz4/lib
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
+LOCAL_LDLIBS += -lpthread
 
 include $(BUILD_HOST_EXECUTABLE)
@@ -16,9 +16,13 @@
 
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
@@ -30,7 +34,8 @@
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 const SourceRange* plan, int plan_count);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -42,23 +47,33 @@ static int GenerateTarget(FileContents* source_file,
                           size_t target_size,
                           const Value* bonus_data);
 
-static int mtd_partitions_scanned = 0;
+static pthread_once_t mtd_scan_once = PTHREAD_ONCE_INIT;
+
+static void ScanMtdPartitions(void) {
+    mtd_scan_partitions();
+}
+
+// retouch_mask_data() keeps its decoder state in globals.
+static pthread_mutex_t retouch_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
 // the retouched entries back to their original value (such that SHA-1 checks
 // don't fail due to randomization); store the file contents and associated
-// metadata in *file.
+// metadata in *file.  Regular files are mapped rather than copied;
+// release the contents with FreeFileContents().
 //
 // Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag) {
     file->data = NULL;
+    file->mapped = 0;
+    file->sparse = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, NULL, -1);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -67,36 +82,61 @@ int LoadFileContents(const char* filename, FileContents* file,
     }
 
     file->size = file->st.st_size;
-    file->data = malloc(file->size);
 
-    FILE* f = fopen(filename, "rb");
-    if (f == NULL) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         printf("failed to open \"%s\": %s\n", filename, strerror(errno));
-        free(file->data);
-        file->data = NULL;
         return -1;
     }
 
-    ssize_t bytes_read = fread(file->data, 1, file->size, f);
-    if (bytes_read != file->size) {
-        printf("short read of \"%s\" (%ld bytes of %ld)\n",
-               filename, (long)bytes_read, (long)file->size);
-        free(file->data);
-        file->data = NULL;
-        return -1;
+    // Map regular files rather than copying them, so hashing and
+    // patching read straight from the page cache.  Retouch masking
+    // rewrites the buffer in place; a private writable mapping lets it
+    // do that without touching the file (only the pages it modifies
+    // get copied).
+    if (file->size > 0 && S_ISREG(file->st.st_mode)) {
+        void* map = mmap(NULL, file->size,
+                         retouch_flag ? PROT_READ | PROT_WRITE : PROT_READ,
+                         MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, file->size, MADV_SEQUENTIAL);
+            file->data = map;
+            file->mapped = 1;
+        }
     }
-    fclose(f);
+
+    if (file->data == NULL) {
+        file->data = malloc(file->size);
+        ssize_t bytes_read = 0;
+        while (bytes_read < file->size) {
+            ssize_t r = read(fd, file->data + bytes_read,
+                             file->size - bytes_read);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            bytes_read += r;
+        }
+        if (bytes_read != file->size) {
+            printf("short read of \"%s\" (%ld bytes of %ld)\n",
+                   filename, (long)bytes_read, (long)file->size);
+            close(fd);
+            FreeFileContents(file);
+            return -1;
+        }
+    }
+    close(fd);
 
     // apply_patch[_check] functions are blind to randomization. Randomization
     // is taken care of in [Undo]RetouchBinariesFn. If there is a mismatch
     // within a file, this means the file is assumed "corrupt" for simplicity.
     if (retouch_flag) {
         int32_t desired_offset = 0;
-        if (retouch_mask_data(file->data, file->size,
-                              &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
+        pthread_mutex_lock(&retouch_lock);
+        int matched = retouch_mask_data(file->data, file->size,
+                                        &desired_offset, NULL);
+        pthread_mutex_unlock(&retouch_lock);
+        if (matched != RETOUCH_DATA_MATCHED) {
             printf("error trying to mask retouch entries\n");
-            free(file->data);
-            file->data = NULL;
+            FreeFileContents(file);
             return -1;
         }
     }
@@ -105,21 +145,389 @@ int LoadFileContents(const char* filename, FileContents* file,
     return 0;
 }
 
-static size_t* size_array;
-// comparison function for qsort()ing an int array of indexes into
-// size_array[].
+// Release the data of a FileContents filled in by LoadFileContents().
+void FreeFileContents(FileContents* file) {
+    if (file->data != NULL) {
+        if (file->mapped) {
+            munmap(file->data, file->size);
+        } else {
+            free(file->data);
+        }
+    }
+    file->data = NULL;
+    file->mapped = 0;
+    file->sparse = 0;
+}
+
+// A size from a partition name, and the position of its (size,sha1)
+// pair in the name.
+typedef struct {
+    size_t size;
+    int index;
+} SizeIndex;
+
+// comparison function for qsort()ing SizeIndex entries by size.
 static int compare_size_indices(const void* a, const void* b) {
-    int aa = *(int*)a;
-    int bb = *(int*)b;
-    if (size_array[aa] < size_array[bb]) {
+    size_t aa = ((const SizeIndex*)a)->size;
+    size_t bb = ((const SizeIndex*)b)->size;
+    if (aa < bb) {
         return -1;
-    } else if (size_array[aa] > size_array[bb]) {
+    } else if (aa > bb) {
         return 1;
     } else {
         return 0;
     }
 }
 
+// Reading EMMC partitions.  Where the kernel allows it the device is
+// mapped read-only and copied straight out of the page cache, with
+// readahead doing the I/O while we hash.  Otherwise a reader thread
+// fills a buffer with large O_DIRECT reads while the caller hashes
+// whatever has already arrived.  In both cases the partition is read
+// only as far as the (size, sha1) pair that matches, plus a bounded
+// amount of readahead, and the caller gets a buffer of its own: the
+// mapping is only ever touched by EmmcHash(), which turns a read
+// error under it into a failed read.  Given a plan, the mapped path
+// copies only the planned ranges into that buffer.
+
+#define EMMC_IO_CHUNK (1 << 20)
+#define EMMC_READ_AHEAD (8 << 20)
+#define EMMC_ALIGN 4096
+
+// Read (or, if 'write' is nonzero, write) 'len' bytes at 'pos',
+// retrying short transfers.  If O_DIRECT turns out to want an
+// alignment we don't meet (the tail of an image, or a device with
+// bigger blocks) the fd is switched to buffered I/O and *direct
+// cleared.  Returns the number of bytes transferred, which is short
+// only at the end of the device, or -1 with errno set.
+static ssize_t EmmcTransfer(int fd, int* direct, int write,
+                            unsigned char* buffer, size_t len, off_t pos) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write ? pwrite(fd, buffer + done, len - done, pos + done)
+                          : pread(fd, buffer + done, len - done, pos + done);
+        if (n > 0) {
+            done += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EINVAL && *direct) {
+            int flags = fcntl(fd, F_GETFL);
+            if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0) {
+                return -1;
+            }
+            *direct = 0;
+        } else {
+            return -1;
+        }
+    }
+    return done;
+}
+
+typedef struct {
+    int fd;
+    int direct;             // fd is open with O_DIRECT
+    size_t limit;           // never need more than this many bytes
+
+    unsigned char* map;     // the mapped device, or NULL; copied into
+    size_t map_size;        // buffer as it's hashed
+    const SourceRange* plan;  // if plan_count >= 0, the only ranges
+    int plan_count;           // worth keeping in memory once hashed
+
+    unsigned char* buffer;  // otherwise reads land here
+    size_t buffer_size;     // limit rounded up to EMMC_ALIGN
+    size_t avail;           // bytes read into buffer so far
+    size_t wanted;          // bytes the hashing side is waiting for
+    int done;               // reader has stopped (limit, EOF or error)
+    int error;              // errno of a failed read, else 0
+    int stop;               // hashing side wants the reader to quit
+    int threaded;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} EmmcReader;
+
+// Read the chunk at 'pos' into the buffer, without holding the
+// lock.  Returns the byte count, 0 at end of device, or -1 with
+// errno set.
+static ssize_t EmmcReadChunk(EmmcReader* r, size_t pos) {
+    size_t len = r->buffer_size - pos;
+    if (len > EMMC_IO_CHUNK) len = EMMC_IO_CHUNK;
+    return EmmcTransfer(r->fd, &r->direct, 0, r->buffer + pos, len, pos);
+}
+
+static void* EmmcReadThread(void* cookie) {
+    EmmcReader* r = (EmmcReader*)cookie;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop && r->avail < r->limit) {
+        if (r->avail >= r->wanted + EMMC_READ_AHEAD) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        size_t pos = r->avail;
+        pthread_mutex_unlock(&r->lock);
+
+        ssize_t n = EmmcReadChunk(r, pos);
+        int err = errno;
+
+        pthread_mutex_lock(&r->lock);
+        if (n <= 0) {
+            if (n < 0) r->error = err;
+            break;
+        }
+        r->avail += n;
+        pthread_cond_broadcast(&r->cond);
+    }
+    r->done = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Open the device and get ready to read up to 'limit' bytes of it.
+// 'plan' (sorted, non-overlapping; see PlanSourceRanges()) lists what
+// the caller will actually read afterwards, or plan_count is -1 if it
+// may read anything.  Returns 0 on success.
+static int EmmcOpen(EmmcReader* r, const char* partition, size_t limit,
+                    const SourceRange* plan, int plan_count) {
+    memset(r, 0, sizeof(*r));
+    r->limit = limit;
+    r->plan = plan;
+    r->plan_count = plan_count;
+
+    r->fd = open(partition, O_RDONLY);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    // Map no further than the end of the device; touching a page past
+    // it would fault rather than come up short.
+    off_t end = lseek(r->fd, 0, SEEK_END);
+    if (end > 0) {
+        r->map_size = (size_t)end < limit ? (size_t)end : limit;
+        r->map = mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, r->fd, 0);
+        if (r->map != MAP_FAILED) {
+            r->buffer = calloc(r->map_size, 1);
+            if (r->buffer != NULL) {
+                madvise(r->map, r->map_size, MADV_SEQUENTIAL);
+                return 0;
+            }
+            munmap(r->map, r->map_size);
+        }
+    }
+    r->map = NULL;
+
+    int fd = open(partition, O_RDONLY | O_DIRECT);
+    if (fd >= 0) {
+        close(r->fd);
+        r->fd = fd;
+        r->direct = 1;
+    }
+
+    r->buffer_size = (limit + EMMC_ALIGN - 1) & ~(size_t)(EMMC_ALIGN - 1);
+    void* buffer;
+    if (posix_memalign(&buffer, EMMC_ALIGN, r->buffer_size) != 0) {
+        close(r->fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    r->buffer = buffer;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->threaded = (pthread_create(&r->thread, NULL, EmmcReadThread, r) == 0);
+    return 0;
+}
+
+// Wait until the first 'want' bytes are available (reading them here
+// if there is no reader thread), and return how many are.  Less than
+// 'want' means EOF or an error.
+static size_t EmmcWait(EmmcReader* r, size_t want) {
+    if (r->map != NULL) {
+        size_t ahead = want + EMMC_READ_AHEAD;
+        if (ahead > r->map_size) ahead = r->map_size;
+        if (ahead > want) {
+            size_t page = want & ~(size_t)(getpagesize() - 1);
+            madvise(r->map + page, ahead - page, MADV_WILLNEED);
+        }
+        return want < r->map_size ? want : r->map_size;
+    }
+
+    if (!r->threaded) {
+        while (r->avail < want && !r->done) {
+            ssize_t n = EmmcReadChunk(r, r->avail);
+            if (n <= 0) {
+                if (n < 0) r->error = errno;
+                r->done = 1;
+            } else {
+                r->avail += n;
+            }
+        }
+        return r->avail;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if (want > r->wanted) {
+        r->wanted = want;
+        pthread_cond_broadcast(&r->cond);
+    }
+    while (r->avail < want && !r->done) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    size_t avail = r->avail;
+    pthread_mutex_unlock(&r->lock);
+    return avail;
+}
+
+static pthread_once_t mapped_fault_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mapped_fault_key;
+static pthread_mutex_t mapped_fault_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mapped_fault_users = 0;
+static struct sigaction mapped_fault_saved;
+
+// A read error under a mapping arrives as SIGBUS.  While a thread is
+// copying mapped data it points mapped_fault_key at a jump buffer so
+// the error can be reported like a failed read.  Any other SIGBUS
+// gets whatever handling was in place before, when the faulting
+// access is retried.
+static void MappedFaultHandler(int sig) {
+    sigjmp_buf* env = (sigjmp_buf*)pthread_getspecific(mapped_fault_key);
+    if (env != NULL) {
+        siglongjmp(*env, 1);
+    }
+    sigaction(sig, &mapped_fault_saved, NULL);
+}
+
+static void CreateMappedFaultKey(void) {
+    pthread_key_create(&mapped_fault_key, NULL);
+}
+
+// The handler is only installed while some thread is in EmmcHash();
+// the last one out puts back the handler it replaced.
+static void BeginMappedFaultGuard(void) {
+    pthread_once(&mapped_fault_once, CreateMappedFaultKey);
+    pthread_mutex_lock(&mapped_fault_lock);
+    if (mapped_fault_users++ == 0) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = MappedFaultHandler;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, &mapped_fault_saved);
+    }
+    pthread_mutex_unlock(&mapped_fault_lock);
+}
+
+static void EndMappedFaultGuard(void) {
+    pthread_mutex_lock(&mapped_fault_lock);
+    if (--mapped_fault_users == 0) {
+        sigaction(SIGBUS, &mapped_fault_saved, NULL);
+    }
+    pthread_mutex_unlock(&mapped_fault_lock);
+}
+
+static void EmmcDrop(EmmcReader* r, size_t start, size_t end) {
+    if (end > start) {
+        madvise(r->map + start, end - start, MADV_DONTNEED);
+        posix_fadvise(r->fd, start, end - start, POSIX_FADV_DONTNEED);
+    }
+}
+
+// Copy [start, end) of the mapping into the buffer: all of it, or
+// with a plan just the planned ranges.  The rest of the buffer is
+// never written, so (being a fresh calloc() of the whole size) it
+// takes no memory.  Planned bytes are in the buffer and the others
+// aren't wanted, so with a plan the whole pages of [start, end) are
+// then let go from the mapping and the page cache.
+static void EmmcCopyPlanned(EmmcReader* r, size_t start, size_t end) {
+    if (r->plan_count < 0) {
+        memcpy(r->buffer + start, r->map + start, end - start);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < r->plan_count; ++i) {
+        size_t from = r->plan[i].start;
+        size_t to = r->plan[i].start + r->plan[i].len;
+        if (to <= start) continue;
+        if (from >= end) break;
+        if (from < start) from = start;
+        if (to > end) to = end;
+        memcpy(r->buffer + from, r->map + from, to - from);
+    }
+
+    size_t page = getpagesize();
+    EmmcDrop(r, (start + page - 1) & ~(page - 1), end & ~(page - 1));
+}
+
+// Hash the partition from 'start' up to 'end' into ctx, one chunk at
+// a time so that hashing overlaps the reads.  Mapped data is hashed
+// and copied into the buffer under the SIGBUS guard.  Returns the
+// number of bytes hashed; less than end-start means the read failed.
+static size_t EmmcHash(EmmcReader* r, SHA_CTX* ctx, size_t start, size_t end) {
+    volatile size_t pos = start;
+    sigjmp_buf env;
+
+    if (r->map != NULL) {
+        BeginMappedFaultGuard();
+        if (sigsetjmp(env, 1) != 0) {
+            pthread_setspecific(mapped_fault_key, NULL);
+            EndMappedFaultGuard();
+            r->error = EIO;
+            return pos - start;
+        }
+        pthread_setspecific(mapped_fault_key, &env);
+    }
+
+    while (pos < end) {
+        size_t want = pos + EMMC_IO_CHUNK;
+        if (want > end) want = end;
+        size_t avail = EmmcWait(r, want);
+        if (avail <= pos) break;
+        if (avail > end) avail = end;
+        if (r->map != NULL) {
+            SHA_update(ctx, r->map + pos, avail - pos);
+            EmmcCopyPlanned(r, pos, avail);
+        } else {
+            SHA_update(ctx, r->buffer + pos, avail - pos);
+        }
+        pos = avail;
+    }
+
+    if (r->map != NULL) {
+        pthread_setspecific(mapped_fault_key, NULL);
+        EndMappedFaultGuard();
+    }
+    return pos - start;
+}
+
+// Stop reading.  If 'keep' is nonzero, hand the buffer (holding
+// everything hashed) over to 'file'; otherwise release it.
+static void EmmcClose(EmmcReader* r, int keep, FileContents* file) {
+    if (r->threaded) {
+        pthread_mutex_lock(&r->lock);
+        r->stop = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+    }
+    if (r->map != NULL) {
+        munmap(r->map, r->map_size);
+    } else {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+    }
+    close(r->fd);
+
+    if (keep) {
+        file->data = r->buffer;
+        file->sparse = r->map != NULL && r->plan_count >= 0;
+    } else {
+        free(r->buffer);
+    }
+}
+
 // Load the contents of an MTD or EMMC partition into the provided
 // FileContents.  filename should be a string of the form
 // "MTD:<partition_name>:<size_1>:<sha1_1>:<size_2>:<sha1_2>:..."  (or
@@ -135,11 +543,19 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If plan_count >= 0, 'plan' lists the only ranges of the data the
+// caller is expected to read (see PlanSourceRanges()).  A mapped EMMC
+// partition is then hashed in a streaming pass that copies only those
+// ranges into file->data and sets file->sparse; nothing else of it
+// stays in memory.  Other partitions are loaded in full either way.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 const SourceRange* plan, int plan_count) {
     char* copy = strdup(filename);
-    const char* magic = strtok(copy, ":");
+    char* saveptr;
+    const char* magic = strtok_r(copy, ":", &saveptr);
 
     enum PartitionType type;
 
@@ -152,7 +568,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                filename);
         return -1;
     }
-    const char* partition = strtok(NULL, ":");
+    const char* partition = strtok_r(NULL, ":", &saveptr);
 
     int i;
     int colons = 0;
@@ -164,38 +580,36 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     if (colons < 3 || colons%2 == 0) {
         printf("LoadPartitionContents called with bad filename (%s)\n",
                filename);
+        free(copy);
+        return -1;
     }
 
     int pairs = (colons-1)/2;     // # of (size,sha1) pairs in filename
-    int* index = malloc(pairs * sizeof(int));
-    size_t* size = malloc(pairs * sizeof(size_t));
+    SizeIndex* size = malloc(pairs * sizeof(SizeIndex));
     char** sha1sum = malloc(pairs * sizeof(char*));
 
     for (i = 0; i < pairs; ++i) {
-        const char* size_str = strtok(NULL, ":");
-        size[i] = strtol(size_str, NULL, 10);
-        if (size[i] == 0) {
+        const char* size_str = strtok_r(NULL, ":", &saveptr);
+        size[i].size = strtol(size_str, NULL, 10);
+        if (size[i].size == 0) {
             printf("LoadPartitionContents called with bad size (%s)\n", filename);
             return -1;
         }
-        sha1sum[i] = strtok(NULL, ":");
-        index[i] = i;
+        sha1sum[i] = strtok_r(NULL, ":", &saveptr);
+        size[i].index = i;
     }
 
-    // sort the index[] array so it indexes the pairs in order of
-    // increasing size.
-    size_array = size;
-    qsort(index, pairs, sizeof(int), compare_size_indices);
+    // sort the size[] array so it has the pairs in order of
+    // increasing size.  (Partition checks run on several threads at
+    // once, so nothing here may be global.)
+    qsort(size, pairs, sizeof(SizeIndex), compare_size_indices);
 
     MtdReadContext* ctx = NULL;
-    FILE* dev = NULL;
+    EmmcReader emmc;
 
     switch (type) {
         case MTD:
-            if (!mtd_partitions_scanned) {
-                mtd_scan_partitions();
-                mtd_partitions_scanned = 1;
-            }
+            pthread_once(&mtd_scan_once, ScanMtdPartitions);
 
             const MtdPartition* mtd = mtd_find_partition_by_name(partition);
             if (mtd == NULL) {
@@ -210,50 +624,58 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                        partition);
                 return -1;
             }
+
+            // allocate enough memory to hold the largest size.
+            file->data = malloc(size[pairs-1].size);
             break;
 
         case EMMC:
-            dev = fopen(partition, "rb");
-            if (dev == NULL) {
+            if (EmmcOpen(&emmc, partition, size[pairs-1].size,
+                         plan, plan_count) != 0) {
                 printf("failed to open emmc partition \"%s\": %s\n",
                        partition, strerror(errno));
                 return -1;
             }
+            break;
     }
 
     SHA_CTX sha_ctx;
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
+    int matched = 0;
 
     for (i = 0; i < pairs; ++i) {
         // Read enough additional bytes to get us up to the next size
         // (again, we're trying the possibilities in order of increasing
         // size).
-        size_t next = size[index[i]] - file->size;
+        size_t next = size[i].size - file->size;
         size_t read = 0;
         if (next > 0) {
             switch (type) {
                 case MTD:
                     read = mtd_read_data(ctx, p, next);
+                    if (read == next) {
+                        SHA_update(&sha_ctx, p, read);
+                    }
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    read = EmmcHash(&emmc, &sha_ctx, file->size,
+                                    size[i].size);
+                    if (read != next && emmc.error != 0) {
+                        printf("error reading partition \"%s\": %s\n",
+                               partition, strerror(emmc.error));
+                    }
                     break;
             }
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
-                return -1;
+                break;
             }
-            SHA_update(&sha_ctx, p, read);
             file->size += read;
         }
 
@@ -263,19 +685,18 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
         const uint8_t* sha_so_far = SHA_final(&temp_ctx);
 
-        if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
+        if (ParseSha1(sha1sum[size[i].index], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
-                   sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
-            return -1;
+                   sha1sum[size[i].index], filename);
+            break;
         }
 
         if (memcmp(sha_so_far, parsed_sha, SHA_DIGEST_SIZE) == 0) {
             // we have a match.  stop reading the partition; we'll return
             // the data we've read so far.
             printf("partition read matched size %d sha %s\n",
-                   size[index[i]], sha1sum[index[i]]);
+                   size[i].size, sha1sum[size[i].index]);
+            matched = 1;
             break;
         }
 
@@ -285,21 +706,24 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     switch (type) {
         case MTD:
             mtd_read_close(ctx);
+            if (!matched) {
+                free(file->data);
+                file->data = NULL;
+            }
             break;
 
         case EMMC:
-            fclose(dev);
+            EmmcClose(&emmc, matched, file);
             break;
     }
 
-
-    if (i == pairs) {
-        // Ran off the end of the list of (size,sha1) pairs without
-        // finding a match.
-        printf("contents of partition \"%s\" didn't match %s\n",
-               partition, filename);
-        free(file->data);
-        file->data = NULL;
+    if (!matched) {
+        if (i == pairs) {
+            // Ran off the end of the list of (size,sha1) pairs without
+            // finding a match.
+            printf("contents of partition \"%s\" didn't match %s\n",
+                   partition, filename);
+        }
         return -1;
     }
 
@@ -314,7 +738,6 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     file->st.st_gid = 0;
 
     free(copy);
-    free(index);
     free(size);
     free(sha1sum);
 
@@ -355,13 +778,591 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
+// Progress journal for EMMC writes.  While a patched image is being
+// written, each EMMC_JOURNAL_WINDOW of it is made durable and then
+// recorded, with its SHA-1, in CACHE_TEMP_JOURNAL.  If the write is
+// interrupted, the next attempt to write the same target finds the
+// windows that already made it to the device and starts after them.
+// The file is a JournalHeader followed by one JournalRecord per
+// committed window, in order.
+#define EMMC_JOURNAL_WINDOW (8 << 20)
+#define JOURNAL_MAGIC "APJRNL01"
+
+typedef struct {
+    char magic[8];
+    uint8_t target_sha1[SHA_DIGEST_SIZE];
+    uint32_t window_size;
+    uint64_t target_size;
+} JournalHeader;
+
+typedef struct {
+    uint32_t window;
+    uint8_t sha1[SHA_DIGEST_SIZE];
+} JournalRecord;
+
+static void WindowSha1(const unsigned char* data, size_t len, size_t window,
+                       uint8_t* digest) {
+    size_t pos = window * EMMC_JOURNAL_WINDOW;
+    size_t n = len - pos < EMMC_JOURNAL_WINDOW ? len - pos : EMMC_JOURNAL_WINDOW;
+    SHA_hash(data + pos, n, digest);
+}
+
+// Open the journal for writing 'data' (whose hash is target_sha1),
+// and store in *committed the number of leading windows it shows
+// were already written with exactly this data.  A journal for
+// anything else is started over.  Returns the journal fd, or -1 if
+// there's no journal to keep (the write goes ahead without one).
+static int OpenJournal(const unsigned char* data, size_t len,
+                       const uint8_t* target_sha1, size_t* committed) {
+    *committed = 0;
+    int fd = open(CACHE_TEMP_JOURNAL, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        printf("not journaling partition write: can't open %s: %s\n",
+               CACHE_TEMP_JOURNAL, strerror(errno));
+        return -1;
+    }
+
+    JournalHeader want;
+    memset(&want, 0, sizeof(want));
+    memcpy(want.magic, JOURNAL_MAGIC, sizeof(want.magic));
+    memcpy(want.target_sha1, target_sha1, SHA_DIGEST_SIZE);
+    want.window_size = EMMC_JOURNAL_WINDOW;
+    want.target_size = len;
+
+    JournalHeader have;
+    if (read(fd, &have, sizeof(have)) == sizeof(have) &&
+        memcmp(&have, &want, sizeof(want)) == 0) {
+        size_t windows = (len + EMMC_JOURNAL_WINDOW - 1) / EMMC_JOURNAL_WINDOW;
+        JournalRecord rec;
+        while (*committed < windows &&
+               read(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+               rec.window == *committed) {
+            uint8_t digest[SHA_DIGEST_SIZE];
+            WindowSha1(data, len, *committed, digest);
+            if (memcmp(digest, rec.sha1, SHA_DIGEST_SIZE) != 0) break;
+            ++*committed;
+        }
+        if (ftruncate(fd, sizeof(want) + *committed * sizeof(rec)) != 0 ||
+            lseek(fd, 0, SEEK_END) < 0) {
+            *committed = 0;
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (ftruncate(fd, 0) != 0 ||
+        lseek(fd, 0, SEEK_SET) != 0 ||
+        write(fd, &want, sizeof(want)) != sizeof(want) ||
+        fsync(fd) != 0) {
+        printf("not journaling partition write: can't write %s: %s\n",
+               CACHE_TEMP_JOURNAL, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Record that 'window' is on the device.  The caller has already
+// flushed the device.
+static int CommitWindow(int fd, const unsigned char* data, size_t len,
+                        size_t window) {
+    JournalRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.window = window;
+    WindowSha1(data, len, window, rec.sha1);
+    if (write(fd, &rec, sizeof(rec)) != sizeof(rec) || fsync(fd) != 0) {
+        printf("failed to update %s: %s\n", CACHE_TEMP_JOURNAL,
+               strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Forget every window from 'window' on.
+static int RewindJournal(int fd, size_t window) {
+    off_t end = sizeof(JournalHeader) + window * sizeof(JournalRecord);
+    if (ftruncate(fd, end) != 0 || lseek(fd, end, SEEK_SET) != end) {
+        return -1;
+    }
+    return 0;
+}
+
+// Block backup of a partition being patched in place.  Rather than
+// copying the whole source image to CACHE_TEMP_SOURCE first, the
+// source contents of each block are saved there just before the
+// block is overwritten, and only if the write changes it.  Blocks
+// past the end of the target, or that the target leaves as they
+// were, stay on the partition.  The source can then be rebuilt at any
+// point by reading the partition and overlaying the saved blocks (see
+// LoadCacheTempSource()).  The file is a BackupHeader followed by
+// BackupRecords, each followed by BACKUP_BLOCK bytes of source data.
+#define BACKUP_MAGIC "APCOW001"
+#define BACKUP_BLOCK 4096
+
+typedef struct {
+    char magic[8];
+    uint8_t source_sha1[SHA_DIGEST_SIZE];
+    uint32_t block_size;
+    uint64_t source_size;
+    char partition[256];        // device the blocks came from
+} BackupHeader;
+
+typedef struct {
+    uint32_t block;
+    uint8_t sha1[SHA_DIGEST_SIZE];  // of the data that follows
+} BackupRecord;
+
+// Read source blocks [b, b + count) into 'buffer' (EMMC_ALIGN-aligned
+// and count blocks long), zero-filling past the end of the source.  A
+// sparse source only holds the ranges the patch reads, so it is read
+// from 'dev' instead; until a block is overwritten, the partition
+// holds exactly the source.  Returns 0 on success.
+static int ReadSourceBlocks(int dev, int* direct, const FileContents* source,
+                            size_t b, size_t count, unsigned char* buffer) {
+    size_t off = b * BACKUP_BLOCK;
+    size_t n = count * BACKUP_BLOCK;
+    if (n > source->size - off) n = source->size - off;
+
+    if (!source->sparse) {
+        memcpy(buffer, source->data + off, n);
+    } else {
+        size_t to_read = (n + EMMC_ALIGN - 1) & ~(size_t)(EMMC_ALIGN - 1);
+        if (EmmcTransfer(dev, direct, 0, buffer, to_read, off) < (ssize_t)n) {
+            if (errno == 0) errno = EIO;
+            return -1;
+        }
+    }
+    memset(buffer + n, 0, count * BACKUP_BLOCK - n);
+    return 0;
+}
+
+// Does writing 'data' change source block b, whose contents are in
+// 'block'?
+static int BlockChanges(const unsigned char* block, size_t source_size,
+                        const unsigned char* data, size_t len, size_t b) {
+    size_t off = b * BACKUP_BLOCK;
+    if (off >= len || off >= source_size) return 0;
+    size_t n = BACKUP_BLOCK;
+    if (n > len - off) n = len - off;
+    if (n > source_size - off) n = source_size - off;
+    return memcmp(block, data + off, n) != 0;
+}
+
+// Open (or start) the block backup for overwriting 'source' on
+// 'partition' (open as 'dev') with 'data', making room on /cache for
+// the blocks still to be saved.  *saved gets a bitmap of the blocks
+// already in the backup, and *changed one of the blocks the write
+// changes; the comparison is made here, once, before anything is
+// written.  Returns the fd, positioned for appending, or -1.
+static int OpenBackup(const char* partition, int dev, int* direct,
+                      const FileContents* source,
+                      const unsigned char* data, size_t len,
+                      uint8_t** saved, uint8_t** changed) {
+    BackupHeader want;
+    memset(&want, 0, sizeof(want));
+    if (strlen(partition) >= sizeof(want.partition)) {
+        printf("partition name %s too long to back up\n", partition);
+        return -1;
+    }
+    memcpy(want.magic, BACKUP_MAGIC, sizeof(want.magic));
+    memcpy(want.source_sha1, source->sha1, SHA_DIGEST_SIZE);
+    want.block_size = BACKUP_BLOCK;
+    want.source_size = source->size;
+    strcpy(want.partition, partition);
+
+    size_t blocks = (source->size + BACKUP_BLOCK - 1) / BACKUP_BLOCK;
+    *saved = calloc((blocks + 7) / 8, 1);
+    *changed = calloc((blocks + 7) / 8, 1);
+    void* aligned = NULL;
+    if (posix_memalign(&aligned, EMMC_ALIGN, EMMC_IO_CHUNK) != 0) {
+        aligned = NULL;
+    }
+    unsigned char* block = aligned;
+    int fd = open(CACHE_TEMP_SOURCE, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (*saved == NULL || *changed == NULL || block == NULL || fd < 0) {
+        printf("failed to open %s: %s\n", CACHE_TEMP_SOURCE, strerror(errno));
+        goto fail;
+    }
+
+    off_t end = 0;
+    BackupHeader have;
+    if (read(fd, &have, sizeof(have)) == sizeof(have) &&
+        memcmp(&have, &want, sizeof(want)) == 0) {
+        // Carry on with the backup an interrupted attempt left.  A
+        // record torn by the interruption ends it.
+        end = sizeof(have);
+        BackupRecord rec;
+        while (read(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+               rec.block < blocks &&
+               read(fd, block, BACKUP_BLOCK) == BACKUP_BLOCK) {
+            uint8_t digest[SHA_DIGEST_SIZE];
+            SHA_hash(block, BACKUP_BLOCK, digest);
+            if (memcmp(digest, rec.sha1, SHA_DIGEST_SIZE) != 0) break;
+            (*saved)[rec.block / 8] |= 1 << (rec.block % 8);
+            end += sizeof(rec) + BACKUP_BLOCK;
+        }
+    }
+    if (ftruncate(fd, end) != 0 || lseek(fd, end, SEEK_SET) != end ||
+        (end == 0 && write(fd, &want, sizeof(want)) != sizeof(want)) ||
+        fsync(fd) != 0) {
+        printf("failed to write %s: %s\n", CACHE_TEMP_SOURCE, strerror(errno));
+        goto fail;
+    }
+
+    // Only the blocks the write reaches can change.
+    size_t reach = len < (size_t)source->size ? len : source->size;
+    size_t last = (reach + BACKUP_BLOCK - 1) / BACKUP_BLOCK;
+    size_t needed = 0;
+    size_t b;
+    for (b = 0; b < last; b += EMMC_IO_CHUNK / BACKUP_BLOCK) {
+        size_t count = last - b;
+        if (count > EMMC_IO_CHUNK / BACKUP_BLOCK) {
+            count = EMMC_IO_CHUNK / BACKUP_BLOCK;
+        }
+        if (ReadSourceBlocks(dev, direct, source, b, count, block) != 0) {
+            printf("failed to read source block %ld of %s: %s\n",
+                   (long)b, partition, strerror(errno));
+            goto fail;
+        }
+        size_t i;
+        for (i = 0; i < count; ++i) {
+            if (BlockChanges(block + i * BACKUP_BLOCK, source->size,
+                             data, len, b + i)) {
+                (*changed)[(b + i) / 8] |= 1 << ((b + i) % 8);
+                if (!((*saved)[(b + i) / 8] & (1 << ((b + i) % 8)))) {
+                    needed += sizeof(BackupRecord) + BACKUP_BLOCK;
+                }
+            }
+        }
+    }
+    if (MakeFreeSpaceOnCache(needed) < 0) {
+        printf("not enough free space on /cache\n");
+        goto fail;
+    }
+    free(aligned);
+    return fd;
+
+  fail:
+    if (fd >= 0) close(fd);
+    free(aligned);
+    free(*saved);
+    free(*changed);
+    *saved = NULL;
+    *changed = NULL;
+    return -1;
+}
+
+// Save the source blocks of 'window' that the write will change and
+// aren't saved yet.
+static int BackupWindow(int fd, int dev, int* direct,
+                        const FileContents* source, size_t window,
+                        uint8_t* saved, const uint8_t* changed) {
+    size_t blocks = (source->size + BACKUP_BLOCK - 1) / BACKUP_BLOCK;
+    size_t b = window * (EMMC_JOURNAL_WINDOW / BACKUP_BLOCK);
+    size_t last = b + EMMC_JOURNAL_WINDOW / BACKUP_BLOCK;
+    if (last > blocks) last = blocks;
+    void* aligned = NULL;
+    int wrote = 0;
+    int result = -1;
+
+    if (posix_memalign(&aligned, EMMC_ALIGN, BACKUP_BLOCK) != 0) {
+        printf("failed to alloc backup buffer\n");
+        return -1;
+    }
+    unsigned char* block = aligned;
+
+    for (; b < last; ++b) {
+        if (!(changed[b / 8] & (1 << (b % 8))) ||
+            (saved[b / 8] & (1 << (b % 8)))) {
+            continue;
+        }
+        if (ReadSourceBlocks(dev, direct, source, b, 1, block) != 0) {
+            printf("failed to read source block %ld: %s\n", (long)b,
+                   strerror(errno));
+            goto done;
+        }
+
+        BackupRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.block = b;
+        SHA_hash(block, BACKUP_BLOCK, rec.sha1);
+        if (write(fd, &rec, sizeof(rec)) != sizeof(rec) ||
+            write(fd, block, BACKUP_BLOCK) != BACKUP_BLOCK) {
+            printf("failed to back up block %ld: %s\n", (long)b,
+                   strerror(errno));
+            goto done;
+        }
+        saved[b / 8] |= 1 << (b % 8);
+        wrote = 1;
+    }
+    if (wrote && fsync(fd) != 0) {
+        printf("failed to sync %s: %s\n", CACHE_TEMP_SOURCE, strerror(errno));
+        goto done;
+    }
+    result = 0;
+
+  done:
+    free(aligned);
+    return result;
+}
+
+// Load the source saved in CACHE_TEMP_SOURCE: either a plain copy of
+// it, or a block backup to lay over the partition it came from.
+static int LoadCacheTempSource(FileContents* file) {
+    file->data = NULL;
+    file->mapped = 0;
+    file->sparse = 0;
+
+    int fd = open(CACHE_TEMP_SOURCE, O_RDONLY);
+    BackupHeader hdr;
+    if (fd < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, BACKUP_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.block_size != BACKUP_BLOCK) {
+        if (fd >= 0) close(fd);
+        return LoadFileContents(CACHE_TEMP_SOURCE, file, RETOUCH_DO_MASK);
+    }
+    hdr.partition[sizeof(hdr.partition)-1] = '\0';
+
+    size_t size = hdr.source_size;
+    size_t blocks = (size + BACKUP_BLOCK - 1) / BACKUP_BLOCK;
+    unsigned char* data = malloc(blocks * BACKUP_BLOCK);
+    unsigned char* block = malloc(BACKUP_BLOCK);
+    int dev = open(hdr.partition, O_RDONLY);
+    if (data == NULL || block == NULL || dev < 0) {
+        printf("failed to rebuild source from %s: %s\n",
+               hdr.partition, strerror(errno));
+        goto fail;
+    }
+    int direct = 0;
+    if (EmmcTransfer(dev, &direct, 0, data, size, 0) != (ssize_t)size) {
+        printf("short read of %s rebuilding source\n", hdr.partition);
+        goto fail;
+    }
+
+    size_t restored = 0;
+    BackupRecord rec;
+    while (read(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+           rec.block < blocks &&
+           read(fd, block, BACKUP_BLOCK) == BACKUP_BLOCK) {
+        uint8_t digest[SHA_DIGEST_SIZE];
+        SHA_hash(block, BACKUP_BLOCK, digest);
+        if (memcmp(digest, rec.sha1, SHA_DIGEST_SIZE) != 0) break;
+        memcpy(data + (size_t)rec.block * BACKUP_BLOCK, block, BACKUP_BLOCK);
+        ++restored;
+    }
+    printf("rebuilt source from %s and %ld saved blocks\n",
+           hdr.partition, (long)restored);
+
+    close(dev);
+    close(fd);
+    free(block);
+    file->data = data;
+    file->size = size;
+    SHA_hash(file->data, file->size, file->sha1);
+    file->st.st_mode = 0644;
+    file->st.st_uid = 0;
+    file->st.st_gid = 0;
+    return 0;
+
+  fail:
+    if (dev >= 0) close(dev);
+    close(fd);
+    free(data);
+    free(block);
+    return -1;
+}
+
+// Write 'len' bytes of data to the start of an EMMC partition, then
+// read them back and compare hashes chunk by chunk.  The I/O is done
+// in EMMC_IO_CHUNK pieces with O_DIRECT where the device allows it,
+// so the read-back comes from the device and not the page cache; a
+// single fsync() between the two passes flushes the device's own
+// cache.  If verification fails we rewrite from the first bad chunk.
+// If target_sha1 is non-NULL the write is journaled (see above), at
+// the cost of a flush per window.  If source is non-NULL it is the
+// partition's current contents, and is block-backed-up as it's
+// overwritten.  Returns 0 on success.
+#define EMMC_WRITE_ATTEMPTS 3
+
+static int WriteToEmmc(const unsigned char* data, size_t len,
+                       const char* partition, const uint8_t* target_sha1,
+                       const FileContents* source) {
+    int direct = 1;
+    int fd = open(partition, O_RDWR | O_DIRECT);
+    if (fd < 0) {
+        direct = 0;
+        fd = open(partition, O_RDWR);
+    }
+    if (fd < 0) {
+        printf("failed to open %s: %s\n", partition, strerror(errno));
+        return -1;
+    }
+
+    size_t chunks = (len + EMMC_IO_CHUNK - 1) / EMMC_IO_CHUNK;
+    uint8_t* expected = malloc(chunks * SHA_DIGEST_SIZE);
+    void* aligned = NULL;
+    if (expected == NULL ||
+        posix_memalign(&aligned, EMMC_ALIGN, EMMC_IO_CHUNK) != 0) {
+        printf("failed to alloc write buffers for %s\n", partition);
+        free(expected);
+        close(fd);
+        return -1;
+    }
+    unsigned char* buffer = aligned;
+
+    size_t c;
+    for (c = 0; c < chunks; ++c) {
+        size_t pos = c * EMMC_IO_CHUNK;
+        size_t n = len - pos < EMMC_IO_CHUNK ? len - pos : EMMC_IO_CHUNK;
+        SHA_hash(data + pos, n, expected + c * SHA_DIGEST_SIZE);
+    }
+
+    int success = 0;
+    size_t start = 0;
+    int journal = -1;
+    int backup = -1;
+    uint8_t* saved = NULL;
+    uint8_t* changed = NULL;
+    if (source != NULL) {
+        backup = OpenBackup(partition, fd, &direct, source, data, len,
+                            &saved, &changed);
+        if (backup < 0) {
+            goto done;
+        }
+    }
+
+    if (target_sha1 != NULL) {
+        size_t committed;
+        journal = OpenJournal(data, len, target_sha1, &committed);
+        start = committed * EMMC_JOURNAL_WINDOW;
+        if (start > len) start = len;
+        if (start > 0) {
+            printf("resuming write of %s after %ld committed bytes\n",
+                   partition, (long)start);
+        }
+    }
+
+    int attempt;
+    for (attempt = 0; attempt < EMMC_WRITE_ATTEMPTS; ++attempt) {
+        printf("raw write %s attempt %d start at %ld%s\n", partition,
+               attempt+1, (long)start, direct ? " (direct)" : "");
+
+        size_t pos;
+        for (pos = start; pos < len; pos += EMMC_IO_CHUNK) {
+            size_t n = len - pos < EMMC_IO_CHUNK ? len - pos : EMMC_IO_CHUNK;
+            size_t to_write = n;
+            if (backup >= 0 &&
+                (pos % EMMC_JOURNAL_WINDOW == 0 || pos == start) &&
+                BackupWindow(backup, fd, &direct, source,
+                             pos / EMMC_JOURNAL_WINDOW, saved, changed) != 0) {
+                goto done;
+            }
+            if (n % EMMC_ALIGN != 0) {
+                // The tail of the image: keep whatever follows it in
+                // its last block, so the write stays block-sized.
+                to_write = (n + EMMC_ALIGN - 1) & ~(size_t)(EMMC_ALIGN - 1);
+                ssize_t got = EmmcTransfer(fd, &direct, 0, buffer,
+                                           to_write, pos);
+                if (got < (ssize_t)to_write) {
+                    to_write = n;
+                }
+            }
+            memcpy(buffer, data + pos, n);
+            if (EmmcTransfer(fd, &direct, 1, buffer, to_write, pos) !=
+                (ssize_t)to_write) {
+                printf("failed write writing to %s at %ld (%s)\n",
+                       partition, (long)pos, strerror(errno));
+                goto done;
+            }
+
+            if (journal >= 0 &&
+                ((pos + n) % EMMC_JOURNAL_WINDOW == 0 || pos + n == len)) {
+                if (fsync(fd) != 0) {
+                    printf("failed to flush %s (%s)\n",
+                           partition, strerror(errno));
+                    goto done;
+                }
+                if (CommitWindow(journal, data, len,
+                                 pos / EMMC_JOURNAL_WINDOW) != 0) {
+                    close(journal);
+                    journal = -1;
+                }
+            }
+        }
+
+        if (fsync(fd) != 0) {
+            printf("failed to flush %s (%s)\n", partition, strerror(errno));
+            goto done;
+        }
+        if (!direct) {
+            // Buffered I/O: make the read-back come from the device.
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+
+        start = len;
+        for (c = 0; c < chunks; ++c) {
+            pos = c * EMMC_IO_CHUNK;
+            size_t n = len - pos < EMMC_IO_CHUNK ? len - pos : EMMC_IO_CHUNK;
+            size_t to_read = (n + EMMC_ALIGN - 1) & ~(size_t)(EMMC_ALIGN - 1);
+            if (EmmcTransfer(fd, &direct, 0, buffer, to_read, pos) <
+                (ssize_t)n) {
+                printf("verify read error %s at %ld: %s\n",
+                       partition, (long)pos, strerror(errno));
+                goto done;
+            }
+            uint8_t digest[SHA_DIGEST_SIZE];
+            SHA_hash(buffer, n, digest);
+            if (memcmp(digest, expected + c * SHA_DIGEST_SIZE,
+                       SHA_DIGEST_SIZE) != 0) {
+                printf("verification failed starting at %ld\n", (long)pos);
+                start = pos;
+                if (journal >= 0 &&
+                    RewindJournal(journal, pos / EMMC_JOURNAL_WINDOW) != 0) {
+                    close(journal);
+                    journal = -1;
+                }
+                break;
+            }
+        }
+
+        if (start == len) {
+            printf("verification read succeeded (attempt %d)\n", attempt+1);
+            success = 1;
+            break;
+        }
+    }
+    if (!success) {
+        printf("failed to verify after all attempts\n");
+    }
+
+  done:
+    if (journal >= 0) close(journal);
+    if (backup >= 0) close(backup);
+    free(saved);
+    free(changed);
+    free(expected);
+    free(aligned);
+    if (close(fd) != 0 && success) {
+        printf("error closing %s (%s)\n", partition, strerror(errno));
+        success = 0;
+    }
+    return success ? 0 : -1;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
-// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
-// success.
+// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  If
+// target_sha1 (the hash of the data) is given, an interrupted EMMC
+// write can be resumed by writing the same data again; if source is
+// given, it's what the EMMC partition holds now, and the blocks of it
+// that get overwritten are saved to CACHE_TEMP_SOURCE.  See
+// WriteToEmmc().  Return 0 on success.
 int WriteToPartition(unsigned char* data, size_t len,
-                        const char* target) {
+                     const char* target, const uint8_t* target_sha1,
+                     const FileContents* source) {
     char* copy = strdup(target);
-    const char* magic = strtok(copy, ":");
+    char* saveptr;
+    const char* magic = strtok_r(copy, ":", &saveptr);
 
     enum PartitionType type;
     if (strcmp(magic, "MTD") == 0) {
@@ -372,7 +1373,7 @@ int WriteToPartition(unsigned char* data, size_t len,
         printf("WriteToPartition called with bad target (%s)\n", target);
         return -1;
     }
-    const char* partition = strtok(NULL, ":");
+    const char* partition = strtok_r(NULL, ":", &saveptr);
 
     if (partition == NULL) {
         printf("bad partition target name \"%s\"\n", target);
@@ -381,10 +1382,7 @@ int WriteToPartition(unsigned char* data, size_t len,
 
     switch (type) {
         case MTD:
-            if (!mtd_partitions_scanned) {
-                mtd_scan_partitions();
-                mtd_partitions_scanned = 1;
-            }
+            pthread_once(&mtd_scan_once, ScanMtdPartitions);
 
             const MtdPartition* mtd = mtd_find_partition_by_name(partition);
             if (mtd == NULL) {
@@ -421,111 +1419,10 @@ int WriteToPartition(unsigned char* data, size_t len,
             break;
 
         case EMMC:
-        {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR | O_SYNC);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
-            int attempt;
-
-            for (attempt = 0; attempt < 10; ++attempt) {
-                size_t next_sync = start + (1<<20);
-                printf("raw O_SYNC write %s attempt %d start at %d\n", partition, attempt+1, start);
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 4096) to_write = 4096;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                    if (start >= next_sync) {
-                        fsync(fd);
-                        next_sync = start + (1<<20);
-                    }
-                }
-                fsync(fd);
-
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
-
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
-                        break;
-                    }
-                }
-
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
-                    break;
-                }
-
-                sleep(2);
-            }
-
-            if (!success) {
-                printf("failed to verify after all attempts\n");
-                return -1;
-            }
-
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
+            if (WriteToEmmc(data, len, partition, target_sha1, source) != 0) {
                 return -1;
             }
-            // hack: sync and sleep after closing in hopes of getting
-            // the data actually onto flash.
-            printf("sleeping after close\n");
-            sync();
-            sleep(5);
             break;
-        }
     }
 
     free(copy);
@@ -597,8 +1494,7 @@ int applypatch_check(const char* filename,
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -606,22 +1502,185 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (LoadCacheTempSource(&file) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
+// Fill in 'check' for 'filename' from a colon-separated list of sha1s
+// (which may be empty).  sha1_list is split in place and must outlive
+// the check; free check->patch_sha1_str when done.  Returns 0 on
+// success.
+int ParsePatchCheck(const char* filename, char* sha1_list, PatchCheck* check) {
+    int count = *sha1_list ? 1 : 0;
+    char* p;
+    for (p = sha1_list; *p; ++p) {
+        if (*p == ':') ++count;
+    }
+
+    check->filename = filename;
+    check->num_patches = 0;
+    check->patch_sha1_str = malloc((count > 0 ? count : 1) * sizeof(char*));
+    check->result = -1;
+    if (check->patch_sha1_str == NULL) {
+        printf("failed to allocate sha1 list for \"%s\"\n", filename);
+        return -1;
+    }
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    char* saveptr;
+    char* sha1;
+    for (sha1 = strtok_r(sha1_list, ":", &saveptr); sha1 != NULL;
+         sha1 = strtok_r(NULL, ":", &saveptr)) {
+        if (ParseSha1(sha1, digest) != 0) {
+            printf("failed to parse sha1 \"%s\" for \"%s\"\n", sha1, filename);
+            free(check->patch_sha1_str);
+            check->patch_sha1_str = NULL;
+            return -1;
+        }
+        check->patch_sha1_str[check->num_patches++] = sha1;
+    }
+    return 0;
+}
+
+// How many checks applypatch_check_batch() runs at once, and roughly
+// how many bytes of source they may hold between them.  A file bigger
+// than the budget is checked on its own.
+#define CHECK_BATCH_THREADS 8
+#define CHECK_BATCH_MEMORY  (128 << 20)
+
+typedef struct {
+    PatchCheck* checks;
+    size_t* footprint;
+    int count;
+    int next;
+    size_t in_flight;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CheckBatch;
+
+// Roughly how much memory checking 'filename' pins: the size of a
+// file, or the largest size named by a partition.
+static size_t CheckFootprint(const char* filename) {
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        char* copy = strdup(filename);
+        char* saveptr;
+        size_t largest = 0;
+
+        // "<type>:<partition>:<size_1>:<sha1_1>:<size_2>:<sha1_2>:..."
+        strtok_r(copy, ":", &saveptr);
+        strtok_r(NULL, ":", &saveptr);
+        char* size_str;
+        while ((size_str = strtok_r(NULL, ":", &saveptr)) != NULL) {
+            size_t size = strtoul(size_str, NULL, 10);
+            if (size > largest) largest = size;
+            if (strtok_r(NULL, ":", &saveptr) == NULL) break;
+        }
+        free(copy);
+        return largest;
+    }
+
+    struct stat st;
+    return stat(filename, &st) == 0 ? st.st_size : 0;
+}
+
+static void* CheckBatchThread(void* cookie) {
+    CheckBatch* batch = (CheckBatch*)cookie;
+
+    pthread_mutex_lock(&batch->lock);
+    while (batch->next < batch->count) {
+        int i = batch->next++;
+        size_t footprint = batch->footprint[i];
+        while (batch->in_flight > 0 &&
+               batch->in_flight + footprint > CHECK_BATCH_MEMORY) {
+            pthread_cond_wait(&batch->cond, &batch->lock);
+        }
+        batch->in_flight += footprint;
+        pthread_mutex_unlock(&batch->lock);
+
+        PatchCheck* check = batch->checks + i;
+        check->result = applypatch_check(check->filename, check->num_patches,
+                                         check->patch_sha1_str);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->in_flight -= footprint;
+        pthread_cond_broadcast(&batch->cond);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// Run applypatch_check() on each of 'checks' using a pool of threads,
+// storing each result in checks[i].result.  Every failing file is
+// listed once all the checks have finished.  Returns the number of
+// files that failed.
+int applypatch_check_batch(int count, PatchCheck* checks) {
+    CheckBatch batch;
+    batch.checks = checks;
+    batch.count = count;
+    batch.next = 0;
+    batch.in_flight = 0;
+    batch.footprint = malloc((count > 0 ? count : 1) * sizeof(size_t));
+    if (batch.footprint == NULL) {
+        printf("failed to allocate check batch\n");
+        return count;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        batch.footprint[i] = CheckFootprint(checks[i].filename);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : (cpus > CHECK_BATCH_THREADS ?
+                                  CHECK_BATCH_THREADS : (int)cpus);
+    if (threads > count) threads = count;
+
+    // The calling thread works through the batch alongside the pool.
+    pthread_t pool[CHECK_BATCH_THREADS];
+    int started = 0;
+    while (started < threads - 1 &&
+           pthread_create(&pool[started], NULL, CheckBatchThread, &batch) == 0) {
+        ++started;
+    }
+    CheckBatchThread(&batch);
+    for (i = 0; i < started; ++i) {
+        pthread_join(pool[i], NULL);
+    }
+
+    pthread_cond_destroy(&batch.cond);
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.footprint);
+
+    int failures = 0;
+    for (i = 0; i < count; ++i) {
+        if (checks[i].result != 0) ++failures;
+    }
+    if (failures > 0) {
+        printf("%d of %d files failed check:\n", failures, count);
+        for (i = 0; i < count; ++i) {
+            if (checks[i].result != 0) {
+                printf("  %s\n", checks[i].filename);
+            }
+        }
+    }
+    return failures;
+}
+
 int ShowLicenses() {
     ShowBSDiffLicense();
     return 0;
@@ -669,9 +1728,11 @@ size_t FreeSpaceForFile(const char* filename) {
     return sf.f_bsize * sf.f_bfree;
 }
 
-int CacheSizeCheck(size_t bytes) {
-    if (MakeFreeSpaceOnCache(bytes) < 0) {
-        printf("unable to make %ld bytes available on /cache\n", (long)bytes);
+// Make sure /cache has room for each of a sequence of 'count' patch
+// steps needing bytes[i] each.  Returns 0 if it does.
+int CacheSizeCheck(int count, const size_t* bytes) {
+    if (PlanCacheSpace(count, bytes, CACHE_EVICT_LARGEST) < 0) {
+        printf("unable to make room for %d step(s) on /cache\n", count);
         return 1;
     } else {
         return 0;
@@ -713,6 +1774,105 @@ static void print_short_sha1(const uint8_t sha1[SHA_DIGEST_SIZE]) {
 // See the comments for the LoadPartition Contents() function above
 // for the format of such a filename.
 
+static int compare_source_ranges(const void* a, const void* b) {
+    const SourceRange* ra = (const SourceRange*)a;
+    const SourceRange* rb = (const SourceRange*)b;
+    if (ra->start != rb->start) return ra->start < rb->start ? -1 : 1;
+    return 0;
+}
+
+// Work out which ranges of the source any of the given patches could
+// read, as a malloc'd, sorted list of non-overlapping ranges in
+// *plan.  Returns the number of ranges, or -1 if some patch may read
+// all of its source (anything but an imgdiff patch).
+static int PlanSourceRanges(int num_patches, Value** patch_data,
+                            SourceRange** plan) {
+    int count = 0;
+    *plan = NULL;
+
+    int i;
+    for (i = 0; i < num_patches; ++i) {
+        if (patch_data[i] == NULL) continue;
+        SourceRange* ranges;
+        int n = ImagePatchSourceRanges(patch_data[i], &ranges);
+        if (n < 0) {
+            free(*plan);
+            *plan = NULL;
+            return -1;
+        }
+        SourceRange* grown = realloc(*plan, (count + n + 1) * sizeof(SourceRange));
+        if (grown == NULL) {
+            free(ranges);
+            free(*plan);
+            *plan = NULL;
+            return -1;
+        }
+        *plan = grown;
+        memcpy(*plan + count, ranges, n * sizeof(SourceRange));
+        count += n;
+        free(ranges);
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+    qsort(*plan, count, sizeof(SourceRange), compare_source_ranges);
+    int merged = 0;
+    for (i = 1; i < count; ++i) {
+        SourceRange* last = *plan + merged;
+        if ((*plan)[i].start <= last->start + last->len) {
+            size_t end = (*plan)[i].start + (*plan)[i].len;
+            if (end > last->start + last->len) last->len = end - last->start;
+        } else {
+            (*plan)[++merged] = (*plan)[i];
+        }
+    }
+    return merged + 1;
+}
+
+// LoadFileContents(), except that a mapped EMMC partition only keeps
+// the planned ranges in memory (see LoadPartitionContents()).
+static int LoadPatchSource(const char* filename, FileContents* file,
+                           const SourceRange* plan, int plan_count) {
+    if (plan_count >= 0 && strncmp(filename, "EMMC:", 5) == 0) {
+        file->data = NULL;
+        file->mapped = 0;
+        file->sparse = 0;
+        return LoadPartitionContents(filename, file, plan, plan_count);
+    }
+    return LoadFileContents(filename, file, RETOUCH_DO_MASK);
+}
+
+// Read the rest of a sparse source loaded from 'filename'
+// ("EMMC:<device>:...") so that all of it can be saved, and check it
+// against the hash taken when it was loaded.
+static int FillSparseSource(const char* filename, FileContents* file) {
+    const char* device = strchr(filename, ':') + 1;
+    char* path = strndup(device, strcspn(device, ":"));
+    int fd = open(path, O_RDONLY);
+    int direct = 0;
+    int result = -1;
+    uint8_t digest[SHA_DIGEST_SIZE];
+
+    if (fd < 0) {
+        printf("failed to open %s: %s\n", path, strerror(errno));
+    } else if (EmmcTransfer(fd, &direct, 0, file->data, file->size, 0) !=
+               file->size) {
+        printf("failed to read %s: %s\n", path, strerror(errno));
+    } else {
+        SHA_hash(file->data, file->size, digest);
+        if (memcmp(digest, file->sha1, SHA_DIGEST_SIZE) != 0) {
+            printf("%s changed since it was loaded\n", path);
+        } else {
+            file->sparse = 0;
+            result = 0;
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(path);
+    return result;
+}
+
 int applypatch(const char* source_filename,
                const char* target_filename,
                const char* target_sha1_str,
@@ -741,16 +1901,22 @@ int applypatch(const char* source_filename,
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
+    // Image patches of a partition usually read only parts of it; the
+    // rest needn't stay in memory once it has been hashed.
+    SourceRange* plan;
+    int plan_count = PlanSourceRanges(num_patches, patch_data, &plan);
+
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
-                         RETOUCH_DO_MASK) == 0) {
+    if (LoadPatchSource(target_filename, &source_file,
+                        plan, plan_count) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("already ");
             print_short_sha1(target_sha1);
             putchar('\n');
-            free(source_file.data);
+            FreeFileContents(&source_file);
+            free(plan);
             return 0;
         }
     }
@@ -760,10 +1926,8 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
-                         RETOUCH_DO_MASK);
+        FreeFileContents(&source_file);
+        LoadPatchSource(source_filename, &source_file, plan, plan_count);
     }
 
     if (source_file.data != NULL) {
@@ -775,14 +1939,13 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
-                             RETOUCH_DO_MASK) < 0) {
+        if (LoadCacheTempSource(&copy_file) < 0) {
             // fail.
             printf("failed to read copy file\n");
+            free(plan);
             return 1;
         }
 
@@ -795,7 +1958,8 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
+            free(plan);
             return 1;
         }
     }
@@ -804,9 +1968,45 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
+    free(plan);
+
+    return result;
+}
+
+// Do two "MTD:<partition>:..." or "EMMC:<device>:..." names refer to
+// the same partition?  An EMMC device can be reached by more than one
+// path (eg a by-name symlink), so those are compared by the device
+// they stat to rather than by name.  Returns 1 if they do, 0 if they
+// don't, and -1 if that can't be told because a stat failed.
+static int SamePartition(const char* a, const char* b) {
+    const char* ca = strchr(a, ':');
+    const char* cb = strchr(b, ':');
+    if (ca == NULL || cb == NULL || ca - a != cb - b ||
+        strncmp(a, b, ca - a) != 0) {
+        return 0;
+    }
+    size_t la = strcspn(ca + 1, ":");
+    size_t lb = strcspn(cb + 1, ":");
+    if (strncmp(a, "MTD:", 4) == 0) {
+        return la == lb && strncmp(ca + 1, cb + 1, la) == 0;
+    }
 
+    char* da = strndup(ca + 1, la);
+    char* db = strndup(cb + 1, lb);
+    struct stat sa, sb;
+    int result;
+    if (stat(da, &sa) != 0 || stat(db, &sb) != 0) {
+        printf("failed to stat partition device: %s\n", strerror(errno));
+        result = -1;
+    } else if (S_ISBLK(sa.st_mode) && S_ISBLK(sb.st_mode)) {
+        result = sa.st_rdev == sb.st_rdev;
+    } else {
+        result = sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    }
+    free(da);
+    free(db);
     return result;
 }
 
@@ -826,6 +2026,7 @@ static int GenerateTarget(FileContents* source_file,
     FileContents* source_to_use;
     char* outname;
     int made_copy = 0;
+    int same_partition = 0;
 
     // assume that target_filename (eg "/system/app/Foo.apk") is located
     // on the same filesystem as its top-level directory ("/system").
@@ -852,15 +2053,36 @@ static int GenerateTarget(FileContents* source_file,
             // /tmp, so instead we'll just assume that /tmp has enough
             // space to hold the file.
 
-            // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            // We still back up the original source on /cache, in case
+            // the partition write is interrupted.  For an EMMC
+            // partition patched in place, that happens block by block
+            // as the write overwrites the source; MTD partitions, and
+            // EMMC sources we can't tell apart from the target, get a
+            // full copy up front.  If we're working from the backup,
+            // an earlier attempt was interrupted: the backup is
+            // already there, and the journal it left lets the write
+            // pick up where it stopped.
+            same_partition = SamePartition(source_filename, target_filename);
+            if (source_patch_value != NULL) {
+                unlink(CACHE_TEMP_JOURNAL);
+                if (strncmp(target_filename, "MTD:", 4) == 0 ||
+                    same_partition < 0) {
+                    if (MakeFreeSpaceOnCache(source_file->size) < 0) {
+                        printf("not enough free space on /cache\n");
+                        return 1;
+                    }
+                    if (source_file->sparse &&
+                        FillSparseSource(source_filename, source_file) != 0) {
+                        printf("failed to read all of source file\n");
+                        return 1;
+                    }
+                    if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                        printf("failed to back up source file\n");
+                        return 1;
+                    }
+                } else {
+                    unlink(CACHE_TEMP_SOURCE);
+                }
             }
             made_copy = 1;
             retry = 0;
@@ -906,6 +2128,19 @@ static int GenerateTarget(FileContents* source_file,
                     return 1;
                 }
                 made_copy = 1;
+
+                // A mapping of the source would keep its blocks allocated
+                // after the unlink; read from the copy we just saved instead.
+                if (source_file->mapped) {
+                    struct stat st = source_file->st;
+                    FreeFileContents(source_file);
+                    if (LoadFileContents(CACHE_TEMP_SOURCE, source_file,
+                                         RETOUCH_DONT_MASK) != 0) {
+                        printf("failed to reload backed-up source file\n");
+                        return 1;
+                    }
+                    source_file->st = st;
+                }
                 unlink(source_filename);
 
                 size_t free_space = FreeSpaceForFile(target_fs);
@@ -968,7 +2203,8 @@ static int GenerateTarget(FileContents* source_file,
         int result;
 
         if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
+            (memcmp(header, "BSDIFF40", 8) == 0 ||
+             memcmp(header, "BSDIFFZ1", 8) == 0)) {
             result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
         } else if (header_bytes_read >= 8 &&
@@ -1013,11 +2249,17 @@ static int GenerateTarget(FileContents* source_file,
 
     if (output < 0) {
         // Copy the temp file to the partition.
-        if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
+        const FileContents* backup_source = NULL;
+        if (same_partition > 0) {
+            backup_source = source_to_use;
+        }
+        if (WriteToPartition(msi.buffer, msi.pos, target_filename,
+                             target_sha1, backup_source) != 0) {
             printf("write of patched data to %s failed\n", target_filename);
             return 1;
         }
         free(msi.buffer);
+        unlink(CACHE_TEMP_JOURNAL);
     } else {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
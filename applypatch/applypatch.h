@@ -32,8 +32,18 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;   // data is a mapping; see FreeFileContents()
+  int sparse;   // only the planned source ranges of data are filled in
 } FileContents;
 
+// One file for applypatch_check_batch().
+typedef struct _PatchCheck {
+  const char* filename;
+  int num_patches;
+  char** patch_sha1_str;
+  int result;   // applypatch_check() result, filled in by the batch
+} PatchCheck;
+
 // When there isn't enough room on the target filesystem to hold the
 // patched version of the file, we copy the original here and delete
 // it to free up space.  If the expected source file doesn't exist, or
@@ -41,12 +51,17 @@ typedef struct _FileContents {
 // and use it as the source instead.
 #define CACHE_TEMP_SOURCE "/cache/saved.file"
 
+// Progress of an interrupted write of a patched partition, so that
+// retrying from CACHE_TEMP_SOURCE doesn't rewrite what already made
+// it to the device.
+#define CACHE_TEMP_JOURNAL "/cache/saved.journal"
+
 typedef ssize_t (*SinkFn)(unsigned char*, ssize_t, void*);
 
 // applypatch.c
 int ShowLicenses();
 size_t FreeSpaceForFile(const char* filename);
-int CacheSizeCheck(size_t bytes);
+int CacheSizeCheck(int count, const size_t* bytes);
 int ParseSha1(const char* str, uint8_t* digest);
 
 int applypatch(const char* source_filename,
@@ -60,6 +75,8 @@ int applypatch(const char* source_filename,
 int applypatch_check(const char* filename,
                      int num_patches,
                      char** const patch_sha1_str);
+int ParsePatchCheck(const char* filename, char* sha1_list, PatchCheck* check);
+int applypatch_check_batch(int count, PatchCheck* checks);
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
@@ -68,22 +85,48 @@ void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
                       int num_patches);
 
-// bsdiff.c
+// bspatch.c
+
+// How much output ApplyBSDiffPatch() accumulates before passing it to
+// the sink; this, not the target size, bounds its memory use.
+#define BSPATCH_WINDOW_SIZE (1 << 20)
+
 void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
                      SinkFn sink, void* token, SHA_CTX* ctx);
+int ApplyBSDiffPatchWindowed(const unsigned char* old_data, ssize_t old_size,
+                             const Value* patch, ssize_t patch_offset,
+                             SinkFn sink, void* token, SHA_CTX* ctx,
+                             size_t window_size);
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
 
 // imgpatch.c
+
+// A byte range of a patch's source data.
+typedef struct {
+  size_t start;
+  size_t len;
+} SourceRange;
+
+int ImagePatchSourceRanges(const Value* patch, SourceRange** ranges);
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
                     SinkFn sink, void* token, SHA_CTX* ctx,
                     const Value* bonus_data);
 
 // freecache.c
+
+// Which expendable /cache files to delete first when making room.
+typedef enum {
+  CACHE_EVICT_LARGEST,  // fewest deletions
+  CACHE_EVICT_OLDEST,   // least recently modified
+} CacheEvictPolicy;
+
 int MakeFreeSpaceOnCache(size_t bytes_needed);
+int PlanCacheSpace(int count, const size_t* bytes_needed,
+                   CacheEvictPolicy policy);
 
 #endif
@@ -81,6 +81,7 @@ cleanup() {
   testname "removing test files"
   run_command rm $WORK_DIR/bloat.dat
   run_command rm $WORK_DIR/old.file
+  run_command rm $WORK_DIR/new.file
   run_command rm $WORK_DIR/foo
   run_command rm $WORK_DIR/patch.bsdiff
   run_command rm $WORK_DIR/applypatch
@@ -126,6 +127,19 @@ run_command $WORK_DIR/applypatch -c $WORK_DIR/old.file $BAD1_SHA1 $OLD_SHA1 $BAD
 testname "check mode failure"
 run_command $WORK_DIR/applypatch -c $WORK_DIR/old.file $BAD2_SHA1 $BAD1_SHA1 && fail
 
+$ADB push $DATA_DIR/new.file $WORK_DIR
+
+testname "batch check mode single"
+run_command $WORK_DIR/applypatch -C $WORK_DIR/old.file $OLD_SHA1 || fail
+
+testname "batch check mode multiple"
+run_command $WORK_DIR/applypatch -C $WORK_DIR/old.file $BAD1_SHA1:$OLD_SHA1 $WORK_DIR/new.file $NEW_SHA1:$BAD2_SHA1 || fail
+
+testname "batch check mode failure"
+run_command $WORK_DIR/applypatch -C $WORK_DIR/old.file $OLD_SHA1 $WORK_DIR/new.file $BAD1_SHA1:$BAD2_SHA1 && fail
+
+run_command rm $WORK_DIR/new.file
+
 $ADB push $DATA_DIR/old.file $CACHE_TEMP_SOURCE
 # put some junk in the old file
 run_command dd if=/dev/urandom of=$WORK_DIR/old.file count=100 bs=1024 || fail
@@ -45,15 +45,23 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#include "mincrypt/sha.h"
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
@@ -156,6 +164,358 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+/*
+ * SA-IS suffix sorting (Nong, Zhang and Chan, "Two Efficient
+ * Algorithms for Linear Time Suffix Array Construction"), with 32-bit
+ * indices.  Runs in O(n) time and needs 4 bytes per input byte for
+ * the result plus n/8 bytes of type bits, against qsufsort's
+ * O(n log n) time and 16 bytes per byte.
+ *
+ * The string has a virtual sentinel at position n that sorts before
+ * every symbol; it is not stored in SA.  Symbols are bytes at the top
+ * level (cs == 1) and int32_t names in the recursion (cs == 4).
+ */
+
+#define SAIS_CHR(i)	(cs == 1 ? (int32_t)((const u_char *)s)[i] : \
+			 ((const int32_t *)s)[i])
+#define SAIS_TGET(i)	((t[(i)>>3] >> ((i)&7)) & 1)
+#define SAIS_TSET(i,b)	(t[(i)>>3] = (b) ? (t[(i)>>3] | (1<<((i)&7))) : \
+			 (t[(i)>>3] & ~(1<<((i)&7))))
+/* S-type is 1, L-type is 0.  Position 0 is never LMS. */
+#define SAIS_ISLMS(i)	((i) > 0 && SAIS_TGET(i) && !SAIS_TGET((i)-1))
+
+static void sais_buckets(const void *s, int32_t *bkt, int32_t n, int32_t k,
+		int cs, int end)
+{
+	int32_t i, sum = 0;
+
+	memset(bkt, 0, k * sizeof(int32_t));
+	for (i = 0; i < n; i++) bkt[SAIS_CHR(i)]++;
+	for (i = 0; i < k; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	}
+}
+
+static void sais_induce(const u_char *t, int32_t *SA, const void *s,
+		int32_t *bkt, int32_t n, int32_t k, int cs)
+{
+	int32_t i, j;
+
+	/* L-type suffixes, left to right.  The sentinel comes first, and
+	   n-1 (always L-type) is its predecessor. */
+	sais_buckets(s, bkt, n, k, cs, 0);
+	SA[bkt[SAIS_CHR(n-1)]++] = n-1;
+	for (i = 0; i < n; i++) {
+		j = SA[i] - 1;
+		if (SA[i] > 0 && !SAIS_TGET(j)) SA[bkt[SAIS_CHR(j)]++] = j;
+	}
+
+	/* S-type suffixes, right to left. */
+	sais_buckets(s, bkt, n, k, cs, 1);
+	for (i = n-1; i >= 0; i--) {
+		j = SA[i] - 1;
+		if (SA[i] > 0 && SAIS_TGET(j)) SA[--bkt[SAIS_CHR(j)]] = j;
+	}
+}
+
+/* Sort the suffixes of s[0..n-1], whose symbols are in [0, k), into
+   SA[0..n-1].  The bucket array goes in 'spare' (nspare entries of
+   otherwise unused memory) if it fits.  Returns 0 on success, -1 if
+   out of memory. */
+static int sais_main(const void *s, int32_t *SA, int32_t n, int32_t k,
+		int cs, int32_t *spare, int32_t nspare)
+{
+	u_char *t;
+	int32_t *bkt;
+	int32_t i, j, m, name, prev, pos, d;
+
+	if (n == 0) return 0;
+	if (n == 1) {
+		SA[0] = 0;
+		return 0;
+	}
+
+	if ((t = calloc(n / 8 + 1, 1)) == NULL) return -1;
+	if (k <= nspare) {
+		bkt = spare;
+	} else if ((bkt = malloc(k * sizeof(int32_t))) == NULL) {
+		free(t);
+		return -1;
+	}
+
+	/* Classify suffixes; n-1 is L-type because of the sentinel. */
+	SAIS_TSET(n-1, 0);
+	for (i = n-2; i >= 0; i--)
+		SAIS_TSET(i, SAIS_CHR(i) < SAIS_CHR(i+1) ||
+			(SAIS_CHR(i) == SAIS_CHR(i+1) && SAIS_TGET(i+1)));
+
+	/* Stage 1: sort the LMS substrings. */
+	sais_buckets(s, bkt, n, k, cs, 1);
+	for (i = 0; i < n; i++) SA[i] = -1;
+	for (i = 1; i < n; i++)
+		if (SAIS_ISLMS(i)) SA[--bkt[SAIS_CHR(i)]] = i;
+	sais_induce(t, SA, s, bkt, n, k, cs);
+
+	/* Compact the sorted LMS substrings into SA[0..m-1]. */
+	for (i = 0, m = 0; i < n; i++)
+		if (SAIS_ISLMS(SA[i])) SA[m++] = SA[i];
+
+	/* Name them; equal substrings get equal names.  There are at most
+	   n/2 of them, so names fit in SA[m..n-1] indexed by pos/2. */
+	for (i = m; i < n; i++) SA[i] = -1;
+	name = 0;
+	prev = -1;
+	for (i = 0; i < m; i++) {
+		pos = SA[i];
+		for (d = 0; ; d++) {
+			if (prev == -1 || pos+d == n || prev+d == n ||
+			    SAIS_CHR(pos+d) != SAIS_CHR(prev+d) ||
+			    SAIS_TGET(pos+d) != SAIS_TGET(prev+d)) {
+				name++;
+				prev = pos;
+				break;
+			}
+			if (d > 0 && (SAIS_ISLMS(pos+d) || SAIS_ISLMS(prev+d)))
+				break;
+		}
+		SA[m + pos/2] = name - 1;
+	}
+	for (i = n-1, j = n-1; i >= m; i--)
+		if (SA[i] >= 0) SA[j--] = SA[i];
+
+	/* Stage 2: sort the reduced string s1, recursing if the names
+	   aren't unique yet.  SA[m..n-m-1] is free until stage 3. */
+	int32_t *s1 = SA + n - m, *SA1 = SA;
+	if (name < m) {
+		if (sais_main(s1, SA1, m, name, 4, SA + m, n - 2*m) != 0) {
+			if (bkt != spare) free(bkt);
+			free(t);
+			return -1;
+		}
+	} else {
+		for (i = 0; i < m; i++) SA1[s1[i]] = i;
+	}
+
+	/* Stage 3: induce the full order from the sorted LMS suffixes. */
+	for (i = 1, j = 0; i < n; i++)
+		if (SAIS_ISLMS(i)) s1[j++] = i;
+	for (i = 0; i < m; i++) SA1[i] = s1[SA1[i]];
+	for (i = m; i < n; i++) SA[i] = -1;
+	sais_buckets(s, bkt, n, k, cs, 1);
+	for (i = m-1; i >= 0; i--) {
+		j = SA[i];
+		SA[i] = -1;
+		SA[--bkt[SAIS_CHR(j)]] = j;
+	}
+	sais_induce(t, SA, s, bkt, n, k, cs);
+
+	if (bkt != spare) free(bkt);
+	free(t);
+	return 0;
+}
+
+/*
+ * Suffix array of the old data, in the layout qsufsort produces:
+ * oldsize+1 entries, the first being the empty suffix.  Inputs under
+ * 2GB get 32-bit entries from SA-IS; larger ones fall back to
+ * qsufsort and off_t entries.
+ */
+struct SuffixArray {
+	int32_t *I32;
+	off_t *I64;
+	void *map;		/* if loaded from the cache, the mapping */
+	size_t maplen;
+};
+
+#define SA_AT(sa,i)	((sa)->I32 != NULL ? (off_t)(sa)->I32[i] : (sa)->I64[i])
+
+struct SuffixArray *build_suffix_array(u_char *old, off_t oldsize)
+{
+	struct SuffixArray *sa;
+
+	if ((sa = calloc(1, sizeof(*sa))) == NULL) err(1, NULL);
+
+	if (oldsize < INT32_MAX) {
+		if ((sa->I32 = malloc((oldsize+1) * sizeof(int32_t))) == NULL)
+			err(1, NULL);
+		sa->I32[0] = oldsize;
+		if (sais_main(old, sa->I32+1, oldsize, 256, 1, NULL, 0) != 0)
+			err(1, NULL);
+	} else {
+		off_t *V;
+		if (((sa->I64 = malloc((oldsize+1) * sizeof(off_t))) == NULL) ||
+		    ((V = malloc((oldsize+1) * sizeof(off_t))) == NULL))
+			err(1, NULL);
+		qsufsort(sa->I64, V, old, oldsize);
+		free(V);
+	}
+	return sa;
+}
+
+/*
+ * On-disk suffix array cache.  Release builds diff the same source
+ * against many targets, so the suffix array of each source can be
+ * kept in a directory, in a file named after the SHA-1 of the data:
+ *
+ *	0	8	"BSDIFFSA"
+ *	8	4	entry size (4 or 8), in native byte order
+ *	12	4	0
+ *	16	8	length of the data
+ *	24	??	(length+1) entries, in native byte order
+ *
+ * Files are mapped read-only rather than read in.  A file that is
+ * the wrong size, has the wrong header or holds an entry that isn't a
+ * position in the data (so a damaged or foreign file can't send the
+ * search outside old) is ignored and the array rebuilt.  Any error
+ * while writing the cache just means the array isn't cached.
+ */
+#define SA_CACHE_HEADER_SIZE 24
+
+static void sa_cache_path(char *path,size_t pathlen,const char *dir,
+		u_char *old,off_t oldsize)
+{
+	SHA_CTX ctx;
+	const uint8_t *digest;
+	off_t done,n;
+	char hex[SHA_DIGEST_SIZE*2+1];
+	int i;
+
+	SHA_init(&ctx);
+	for(done=0;done<oldsize;done+=n) {
+		n=MIN(oldsize-done,1<<30);
+		SHA_update(&ctx,old+done,n);
+	};
+	digest=SHA_final(&ctx);
+	for(i=0;i<SHA_DIGEST_SIZE;i++)
+		sprintf(hex+i*2,"%02x",digest[i]);
+	snprintf(path,pathlen,"%s/%s.sa",dir,hex);
+}
+
+static int sa_cache_entries_ok(const struct SuffixArray *sa,off_t oldsize)
+{
+	off_t i;
+
+	for(i=0;i<=oldsize;i++) {
+		off_t pos=sa->I32!=NULL ? sa->I32[i] : sa->I64[i];
+		if(pos<0 || pos>oldsize) return 0;
+	};
+	return 1;
+}
+
+static struct SuffixArray *sa_cache_load(const char *path,off_t oldsize)
+{
+	struct SuffixArray *sa;
+	struct stat st;
+	u_char *map;
+	uint32_t entry;
+	int64_t len;
+	int fd;
+
+	if((fd=open(path,O_RDONLY))<0) return NULL;
+	if(fstat(fd,&st)!=0 || st.st_size<SA_CACHE_HEADER_SIZE) {
+		close(fd);
+		return NULL;
+	};
+	map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(map==MAP_FAILED) return NULL;
+
+	memcpy(&entry,map+8,4);
+	memcpy(&len,map+16,8);
+	if(memcmp(map,"BSDIFFSA",8)!=0 || len!=oldsize ||
+	    (entry!=sizeof(int32_t) && entry!=sizeof(off_t)) ||
+	    st.st_size!=SA_CACHE_HEADER_SIZE+(off_t)entry*(oldsize+1)) {
+		warnx("ignoring bad suffix array cache file %s",path);
+		munmap(map,st.st_size);
+		return NULL;
+	};
+
+	if((sa=calloc(1,sizeof(*sa)))==NULL) err(1,NULL);
+	if(entry==sizeof(int32_t))
+		sa->I32=(int32_t *)(map+SA_CACHE_HEADER_SIZE);
+	else
+		sa->I64=(off_t *)(map+SA_CACHE_HEADER_SIZE);
+	sa->map=map;
+	sa->maplen=st.st_size;
+
+	if(!sa_cache_entries_ok(sa,oldsize)) {
+		warnx("ignoring corrupt suffix array cache file %s",path);
+		munmap(map,st.st_size);
+		free(sa);
+		return NULL;
+	};
+	return sa;
+}
+
+static void sa_cache_store(const char *path,const char *dir,
+		const struct SuffixArray *sa,off_t oldsize)
+{
+	char tmp[PATH_MAX];
+	u_char header[SA_CACHE_HEADER_SIZE];
+	uint32_t entry=sa->I32!=NULL ? sizeof(int32_t) : sizeof(off_t);
+	int64_t len=oldsize;
+	const void *data=sa->I32!=NULL ? (void *)sa->I32 : (void *)sa->I64;
+	FILE *f;
+	int fd;
+
+	/* Write under a temporary name and rename into place, so that
+	   readers never see a partial file. */
+	snprintf(tmp,sizeof(tmp),"%s/.sa-XXXXXX",dir);
+	if((fd=mkstemp(tmp))<0) {
+		warn("can't create suffix array cache file in %s",dir);
+		return;
+	};
+	if((f=fdopen(fd,"wb"))==NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	};
+
+	memset(header,0,sizeof(header));
+	memcpy(header,"BSDIFFSA",8);
+	memcpy(header+8,&entry,4);
+	memcpy(header+16,&len,8);
+	if(fwrite(header,1,sizeof(header),f)!=sizeof(header) ||
+	    fwrite(data,entry,oldsize+1,f)!=(size_t)(oldsize+1) ||
+	    fclose(f)!=0 || chmod(tmp,0644)!=0 || rename(tmp,path)!=0) {
+		warn("can't write suffix array cache file %s",path);
+		unlink(tmp);
+	};
+}
+
+/*
+ * Like build_suffix_array(), but first look for the array in
+ * cache_dir (if not NULL), and store it there if it had to be built.
+ */
+struct SuffixArray *load_suffix_array(u_char *old,off_t oldsize,
+		const char *cache_dir)
+{
+	struct SuffixArray *sa;
+	char path[PATH_MAX];
+
+	if(cache_dir==NULL) return build_suffix_array(old,oldsize);
+
+	sa_cache_path(path,sizeof(path),cache_dir,old,oldsize);
+	if((sa=sa_cache_load(path,oldsize))!=NULL) return sa;
+
+	sa=build_suffix_array(old,oldsize);
+	sa_cache_store(path,cache_dir,sa,oldsize);
+	return sa;
+}
+
+void free_suffix_array(struct SuffixArray *sa)
+{
+	if(sa==NULL) return;
+	if(sa->map!=NULL) {
+		munmap(sa->map,sa->maplen);
+	} else {
+		free(sa->I32);
+		free(sa->I64);
+	};
+	free(sa);
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,29 +526,32 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const struct SuffixArray *sa,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
-	off_t x,y;
+	off_t x,y,ist,ien,ix;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		ist=SA_AT(sa,st);
+		ien=SA_AT(sa,en);
+		x=matchlen(old+ist,oldsize-ist,new,newsize);
+		y=matchlen(old+ien,oldsize-ien,new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=ist;
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=ien;
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
+	ix=SA_AT(sa,x);
+	if(memcmp(old+ix,new,MIN(oldsize-ix,newsize))<0) {
+		return search(sa,old,oldsize,new,newsize,x,en,pos);
 	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
+		return search(sa,old,oldsize,new,newsize,st,x,pos);
 	};
 }
 
@@ -210,77 +573,52 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
-// This is main() from bsdiff.c, with the following changes:
-//
-//    - old, oldsize, new, newsize are arguments; we don't load this
-//      data from files.  old and new are owned by the caller; we
-//      don't free them at the end.
-//
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
-//      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
-//
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
-{
-	int fd;
-	off_t *I;
-	off_t scan,pos,len;
+/* State of the bsdiff scan loop between iterations. */
+typedef struct {
+	off_t scan,len,pos;
 	off_t lastscan,lastpos,lastoffset;
-	off_t oldscore,scsc;
-	off_t s,Sf,lenf,Sb,lenb;
-	off_t overlap,Ss,lens;
-	off_t i;
-	off_t dblen,eblen;
-	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
+} ScanState;
 
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
-        }
-        I = *IP;
+/* One control triple: add lenf bytes of old data starting at lastpos
+   to the new data starting at lastscan, copy 'extra' more bytes of
+   new data, then seek the old position by 'seek'.  'after' is the
+   loop state right after the triple was emitted. */
+typedef struct {
+	off_t lastscan,lastpos;
+	off_t lenf,extra,seek;
+	ScanState after;
+} ScanEmit;
 
-	if(((db=malloc(newsize+1))==NULL) ||
-		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
-	dblen=0;
-	eblen=0;
+typedef struct {
+	ScanEmit *e;
+	off_t n,cap;
+} EmitList;
 
-	/* Create the patch file */
-	if ((pf = fopen(patch_filename, "w")) == NULL)
-              err(1, "%s", patch_filename);
+static void emit_append(EmitList *l,const ScanEmit *e)
+{
+	if(l->n==l->cap) {
+		l->cap=l->cap ? l->cap*2 : 1024;
+		if((l->e=realloc(l->e,l->cap*sizeof(ScanEmit)))==NULL)
+			err(1,NULL);
+	};
+	l->e[l->n++]=*e;
+}
 
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of new file */
-	/* File is
-		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
+/* Run the bsdiff scan loop from *st until it emits the next control
+   triple (returning 1) or reaches the end of new (returning 0). */
+static int scan_next(const struct SuffixArray *I,u_char *old,off_t oldsize,
+		u_char *new,off_t newsize,ScanState *st,ScanEmit *e)
+{
+	off_t scan=st->scan,len=st->len,pos=st->pos;
+	off_t lastscan=st->lastscan,lastpos=st->lastpos;
+	off_t lastoffset=st->lastoffset;
+	off_t oldscore,scsc;
+	off_t s,Sf,lenf,Sb,lenb;
+	off_t overlap,Ss,lens;
+	off_t i;
+	int emitted=0;
 
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	scan=0;len=0;
-	lastscan=0;lastpos=0;lastoffset=0;
-	while(scan<newsize) {
+	while(!emitted && scan<newsize) {
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<newsize;scan++) {
@@ -332,79 +670,373 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 				lenb-=lens;
 			};
 
-			for(i=0;i<lenf;i++)
-				db[dblen+i]=new[lastscan+i]-old[lastpos+i];
-			for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-				eb[eblen+i]=new[lastscan+lenf+i];
+			e->lastscan=lastscan;
+			e->lastpos=lastpos;
+			e->lenf=lenf;
+			e->extra=(scan-lenb)-(lastscan+lenf);
+			e->seek=(pos-lenb)-(lastpos+lenf);
 
-			dblen+=lenf;
-			eblen+=(scan-lenb)-(lastscan+lenf);
+			lastscan=scan-lenb;
+			lastpos=pos-lenb;
+			lastoffset=pos-scan;
+			emitted=1;
+		};
+	};
 
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+	st->scan=scan;st->len=len;st->pos=pos;
+	st->lastscan=lastscan;st->lastpos=lastpos;st->lastoffset=lastoffset;
+	if(emitted) e->after=*st;
+	return emitted;
+}
 
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+/* Below this much new data per thread the scan stays serial. */
+#define MIN_SCAN_SEGMENT (1024*1024)
 
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+typedef struct {
+	const struct SuffixArray *I;
+	u_char *old,*new;
+	off_t oldsize,newsize;
+	off_t start,end;
+	EmitList out;
+} ScanSegment;
 
-			lastscan=scan-lenb;
-			lastpos=pos-lenb;
-			lastoffset=pos-scan;
+/* Scan one segment of new from a cold start, until a triple begins at
+   or past the end of the segment. */
+static void *scan_segment(void *cookie)
+{
+	ScanSegment *seg=cookie;
+	ScanState st;
+	ScanEmit e;
+
+	memset(&st,0,sizeof(st));
+	st.scan=st.lastscan=seg->start;
+	while(scan_next(seg->I,seg->old,seg->oldsize,seg->new,seg->newsize,
+			&st,&e)) {
+		emit_append(&seg->out,&e);
+		if(st.lastscan>=seg->end) break;
+	};
+	return NULL;
+}
+
+/*
+ * Produce the control triples for the whole of new.  With several
+ * cores, new is cut into segments which are scanned concurrently,
+ * each starting from a cold state.  The segments are then stitched
+ * together by carrying the real loop state on past each boundary
+ * until it coincides with a state the next segment also reached;
+ * from there on that segment's output is exactly what the serial
+ * loop would have produced.  (If it never coincides, the serial loop
+ * just carries on through the segment.)  So the result, and the
+ * patch, are identical to a serial scan.
+ */
+static void scan_all(const struct SuffixArray *I,u_char *old,off_t oldsize,
+		u_char *new,off_t newsize,EmitList *out)
+{
+	ScanSegment *segs;
+	pthread_t *threads;
+	ScanState st;
+	ScanEmit e;
+	long nthreads;
+	off_t k,nsegs,j;
+	int started;
+
+	memset(&st,0,sizeof(st));
+
+	nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+	nsegs=MIN(nthreads,newsize/MIN_SCAN_SEGMENT);
+	if(nsegs<=1) {
+		while(scan_next(I,old,oldsize,new,newsize,&st,&e))
+			emit_append(out,&e);
+		return;
+	};
+
+	if(((segs=calloc(nsegs,sizeof(ScanSegment)))==NULL) ||
+		((threads=malloc(nsegs*sizeof(pthread_t)))==NULL))
+		err(1,NULL);
+	for(k=0;k<nsegs;k++) {
+		segs[k].I=I;
+		segs[k].old=old;segs[k].oldsize=oldsize;
+		segs[k].new=new;segs[k].newsize=newsize;
+		segs[k].start=newsize/nsegs*k;
+		segs[k].end=(k==nsegs-1) ? newsize : newsize/nsegs*(k+1);
+	};
+	for(started=0;started<nsegs-1;started++)
+		if(pthread_create(&threads[started],NULL,scan_segment,
+				&segs[started+1])!=0) break;
+	/* Segment 0 starts from the real initial state, so it needs
+	   no stitching. */
+	scan_segment(&segs[0]);
+	for(k=0;k<started;k++) pthread_join(threads[k],NULL);
+	for(k=started+1;k<nsegs;k++) scan_segment(&segs[k]);
+
+	for(j=0;j<segs[0].out.n;j++) emit_append(out,&segs[0].out.e[j]);
+	if(segs[0].out.n>0) st=segs[0].out.e[segs[0].out.n-1].after;
+
+	for(k=1;k<nsegs && st.scan<newsize;k++) {
+		EmitList *l=&segs[k].out;
+		off_t last=l->n>0 ? l->e[l->n-1].after.lastscan : -1;
+
+		j=0;
+		for(;;) {
+			/* Does the next segment ever reach this state? */
+			while(j<l->n && l->e[j].after.lastscan<st.lastscan) j++;
+			while(j<l->n && l->e[j].after.lastscan==st.lastscan &&
+				memcmp(&l->e[j].after,&st,sizeof(st))!=0) j++;
+			if(j<l->n && memcmp(&l->e[j].after,&st,sizeof(st))==0) {
+				for(j++;j<l->n;j++) emit_append(out,&l->e[j]);
+				st=l->e[l->n-1].after;
+				break;
+			};
+			if(st.lastscan>last) break;
+			if(!scan_next(I,old,oldsize,new,newsize,&st,&e)) break;
+			emit_append(out,&e);
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
 
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(len-32, header + 8);
+	/* Finish serially if stitching ran off the last segment. */
+	while(scan_next(I,old,oldsize,new,newsize,&st,&e))
+		emit_append(out,&e);
+
+	for(k=0;k<nsegs;k++) free(segs[k].out.e);
+	free(segs);
+	free(threads);
+}
+
+/* Growable in-memory patch. */
+typedef struct {
+	u_char *data;
+	size_t len,cap;
+} PatchBuf;
+
+static u_char *patchbuf_space(PatchBuf *pb,size_t want)
+{
+	if(pb->cap-pb->len<want) {
+		size_t cap=pb->cap ? pb->cap : 65536;
+		while(cap-pb->len<want) cap*=2;
+		if((pb->data=realloc(pb->data,cap))==NULL) err(1,NULL);
+		pb->cap=cap;
+	};
+	return pb->data+pb->len;
+}
+
+/* One compressed block of the patch: bzip2 for BSDIFF40 patches,
+   zlib for BSDIFFZ1 ones. */
+typedef struct {
+	PatchBuf *pb;
+	int use_zlib;
+	bz_stream bz;
+	z_stream z;
+} BlockWriter;
+
+static void block_open(BlockWriter *w, PatchBuf *pb, int use_zlib)
+{
+	int ret;
+
+	w->pb = pb;
+	w->use_zlib = use_zlib;
+	if (use_zlib) {
+		memset(&w->z, 0, sizeof(w->z));
+		if ((ret = deflateInit(&w->z, Z_BEST_COMPRESSION)) != Z_OK)
+			errx(1, "deflateInit, ret = %d", ret);
+	} else {
+		memset(&w->bz, 0, sizeof(w->bz));
+		if ((ret = BZ2_bzCompressInit(&w->bz, 9, 0, 0)) != BZ_OK)
+			errx(1, "BZ2_bzCompressInit, bz2err = %d", ret);
+	}
+}
+
+/* Feed 'len' bytes to the compressor (finishing the stream if
+   'finish' is set), appending its output to the patch. */
+static void block_run(BlockWriter *w, u_char *data, size_t len, int finish)
+{
+	const unsigned int chunk = 65536;
+	int ret;
+
+	if (w->use_zlib) {
+		w->z.next_in = data;
+		w->z.avail_in = len;
+		do {
+			w->z.next_out = patchbuf_space(w->pb, chunk);
+			w->z.avail_out = chunk;
+			ret = deflate(&w->z, finish ? Z_FINISH : Z_NO_FLUSH);
+			if (ret == Z_STREAM_ERROR)
+				errx(1, "deflate, ret = %d", ret);
+			w->pb->len += chunk - w->z.avail_out;
+		} while (w->z.avail_out == 0 ||
+			 (finish && ret != Z_STREAM_END));
+	} else {
+		w->bz.next_in = (char *)data;
+		w->bz.avail_in = len;
+		do {
+			w->bz.next_out = (char *)patchbuf_space(w->pb, chunk);
+			w->bz.avail_out = chunk;
+			ret = BZ2_bzCompress(&w->bz, finish ? BZ_FINISH : BZ_RUN);
+			if (ret != BZ_RUN_OK && ret != BZ_FINISH_OK &&
+			    ret != BZ_STREAM_END)
+				errx(1, "BZ2_bzCompress, bz2err = %d", ret);
+			w->pb->len += chunk - w->bz.avail_out;
+		} while (w->bz.avail_in > 0 || w->bz.avail_out == 0 ||
+			 (finish && ret != BZ_STREAM_END));
+	}
+}
+
+static void block_write(BlockWriter *w, u_char *data, off_t len)
+{
+	/* avail_in is only an unsigned int */
+	while (len > 0) {
+		off_t n = MIN(len, 1 << 30);
+		block_run(w, data, n, 0);
+		data += n;
+		len -= n;
+	}
+}
+
+static void block_close(BlockWriter *w)
+{
+	block_run(w, NULL, 0, 1);
+	if (w->use_zlib)
+		deflateEnd(&w->z);
+	else
+		BZ2_bzCompressEnd(&w->bz);
+}
+
+// This is main() from bsdiff.c, with the following changes:
+//
+//    - old, oldsize, new, newsize are arguments; we don't load this
+//      data from files.  old and new are owned by the caller; we
+//      don't free them at the end.
+//
+//    - the suffix array is owned by the caller, who passes a pointer
+//      to *IP, which can be NULL.  This way if we call bsdiff()
+//      multiple times with the same 'old' data, we only do the
+//      suffix sorting step the first time.  (Callers that share one
+//      array between threads must build it first, with
+//      build_suffix_array().)
+//
+//    - the patch is returned in a malloc'd buffer (*patch, *patch_size)
+//      rather than written to a file; bsdiff() below writes it out.
+//
+//    - if use_zlib is set, the three blocks are compressed with zlib
+//      instead of bzip2 and the magic is "BSDIFFZ1".  Such patches are
+//      usually a little bigger but decode several times faster.
+//
+int bsdiff_mem(u_char* old, off_t oldsize, struct SuffixArray** IP,
+               u_char* new, off_t newsize,
+               u_char** patch, size_t* patch_size, int use_zlib)
+{
+	struct SuffixArray *I;
+	EmitList emits;
+	ScanEmit *e;
+	off_t i,k;
+	off_t dblen,eblen;
+	u_char *db,*eb;
+	u_char buf[8];
+	u_char *header;
+	size_t ctrl_end,diff_end;
+	PatchBuf pb;
+	BlockWriter bw;
+
+        if (*IP == NULL) {
+            *IP = build_suffix_array(old, oldsize);
+        }
+        I = *IP;
+
+	if(((db=malloc(newsize+1))==NULL) ||
+		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
+	dblen=0;
+	eblen=0;
+
+	memset(&pb,0,sizeof(pb));
+
+	/* Header is
+		0	8	 "BSDIFF40" (or "BSDIFFZ1")
+		8	8	length of bzip2ed ctrl block
+		16	8	length of bzip2ed diff block
+		24	8	length of new file */
+	/* File is
+		0	32	Header
+		32	??	Bzip2ed ctrl block
+		??	??	Bzip2ed diff block
+		??	??	Bzip2ed extra block
+	   with zlib in place of bzip2 for BSDIFFZ1.  The lengths are
+	   filled in at the end. */
+	patchbuf_space(&pb, 32);
+	pb.len = 32;
+
+	/* Compute the differences, writing ctrl as we go */
+	memset(&emits,0,sizeof(emits));
+	scan_all(I,old,oldsize,new,newsize,&emits);
+
+	block_open(&bw, &pb, use_zlib);
+	for(k=0;k<emits.n;k++) {
+		e=&emits.e[k];
+
+		for(i=0;i<e->lenf;i++)
+			db[dblen+i]=new[e->lastscan+i]-old[e->lastpos+i];
+		for(i=0;i<e->extra;i++)
+			eb[eblen+i]=new[e->lastscan+e->lenf+i];
+
+		dblen+=e->lenf;
+		eblen+=e->extra;
+
+		offtout(e->lenf,buf);
+		block_write(&bw, buf, 8);
+
+		offtout(e->extra,buf);
+		block_write(&bw, buf, 8);
+
+		offtout(e->seek,buf);
+		block_write(&bw, buf, 8);
+	};
+	free(emits.e);
+	block_close(&bw);
+	ctrl_end = pb.len;
 
 	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
+	block_open(&bw, &pb, use_zlib);
+	block_write(&bw, db, dblen);
+	block_close(&bw);
+	diff_end = pb.len;
 
 	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseeko(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-	if (fclose(pf))
-		err(1, "fclose");
+	block_open(&bw, &pb, use_zlib);
+	block_write(&bw, eb, eblen);
+	block_close(&bw);
+
+	/* Now the header */
+	header = pb.data;
+	memcpy(header,use_zlib ? "BSDIFFZ1" : "BSDIFF40",8);
+	offtout(ctrl_end - 32, header + 8);
+	offtout(diff_end - ctrl_end, header + 16);
+	offtout(newsize, header + 24);
 
 	/* Free the memory we used */
 	free(db);
 	free(eb);
 
+	*patch = pb.data;
+	*patch_size = pb.len;
+	return 0;
+}
+
+int bsdiff(u_char* old, off_t oldsize, struct SuffixArray** IP,
+           u_char* new, off_t newsize,
+           const char* patch_filename, int use_zlib)
+{
+	FILE * pf;
+	u_char *patch;
+	size_t patch_size;
+
+	bsdiff_mem(old, oldsize, IP, new, newsize, &patch, &patch_size,
+		   use_zlib);
+
+	if ((pf = fopen(patch_filename, "w")) == NULL)
+		err(1, "%s", patch_filename);
+	if (fwrite(patch, 1, patch_size, pf) != patch_size)
+		err(1, "fwrite(%s)", patch_filename);
+	if (fclose(pf))
+		err(1, "fclose");
+	free(patch);
+
 	return 0;
 }
@@ -23,11 +23,19 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
 #include <bzlib.h>
 
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "zlib.h"
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 
@@ -81,48 +89,258 @@ static off_t offtin(u_char *buf)
     return y;
 }
 
-int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
-    stream->next_out = (char*)buffer;
-    stream->avail_out = size;
-    while (stream->avail_out > 0) {
-        int bzerr = BZ2_bzDecompress(stream);
-        if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
-            printf("bz error %d decompressing\n", bzerr);
+// Size of the ring buffer each decompression thread fills ahead of
+// the combiner.
+#define PIPE_RING_SIZE (256 * 1024)
+
+// One of the three compressed streams of a bsdiff patch: bzip2 for
+// BSDIFF40 patches, zlib for BSDIFFZ1 ones.  It is either read on
+// demand with FillBuffer(), or (if 'ring' is non-NULL) decompressed
+// ahead by its own thread into a ring buffer.  'produced' and
+// 'consumed' count bytes since the start of the stream; the data
+// between them is in the ring.
+typedef struct {
+    int use_zlib;
+    bz_stream bz;
+    z_stream z;
+    const char* name;
+
+    unsigned char* ring;
+    size_t produced;
+    size_t consumed;
+    int done;               // producer has stopped (end or error)
+    int failed;             // producer hit a decompression error
+    int stop;               // consumer wants the producer to quit
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} PatchPipe;
+
+// The three streams of a bsdiff patch, plus the target size from its
+// header.
+typedef struct {
+    PatchPipe ctrl;
+    PatchPipe diff;
+    PatchPipe extra;
+    ssize_t new_size;
+} BSDiffStreams;
+
+// Decompress up to 'size' bytes from the pipe's stream into buffer,
+// storing the amount produced in *written.  Returns 1 at the end of
+// the stream, 0 if there may be more, and -1 on error (including
+// compressed input that runs out before the end of the stream).
+static int DecompressSome(PatchPipe* pipe, unsigned char* buffer,
+                          size_t size, size_t* written) {
+    int ret, end;
+    unsigned int avail_in;
+
+    if (pipe->use_zlib) {
+        pipe->z.next_out = buffer;
+        pipe->z.avail_out = size;
+        ret = inflate(&pipe->z, Z_NO_FLUSH);
+        *written = size - pipe->z.avail_out;
+        avail_in = pipe->z.avail_in;
+        end = (ret == Z_STREAM_END);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            printf("zlib error %d decompressing %s stream\n", ret, pipe->name);
             return -1;
         }
-        if (stream->avail_out > 0) {
-            printf("need %d more bytes\n", stream->avail_out);
+    } else {
+        pipe->bz.next_out = (char*)buffer;
+        pipe->bz.avail_out = size;
+        ret = BZ2_bzDecompress(&pipe->bz);
+        *written = size - pipe->bz.avail_out;
+        avail_in = pipe->bz.avail_in;
+        end = (ret == BZ_STREAM_END);
+        if (ret != BZ_OK && ret != BZ_STREAM_END) {
+            printf("bz error %d decompressing %s stream\n", ret, pipe->name);
+            return -1;
         }
     }
+    if (end) {
+        return 1;
+    }
+    if (*written < size && avail_in == 0) {
+        // Output space left over and no input to fill it with: the
+        // stream is truncated.
+        printf("%s stream ended early\n", pipe->name);
+        return -1;
+    }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+static int FillBuffer(unsigned char* buffer, size_t size, PatchPipe* pipe) {
+    while (size > 0) {
+        size_t n;
+        int ret = DecompressSome(pipe, buffer, size, &n);
+        buffer += n;
+        size -= n;
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret > 0 && size > 0) {
+            // No more data is coming; don't spin forever.
+            printf("need %ld more bytes\n", (long)size);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
+static void* PatchPipeThread(void* cookie) {
+    PatchPipe* pipe = (PatchPipe*)cookie;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->stop) {
+        size_t used = pipe->produced - pipe->consumed;
+        if (used == PIPE_RING_SIZE) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+            continue;
+        }
+
+        // Decompress into the free space up to the end of the ring,
+        // without holding the lock; the consumer never touches it.
+        size_t offset = pipe->produced % PIPE_RING_SIZE;
+        size_t space = PIPE_RING_SIZE - used;
+        if (space > PIPE_RING_SIZE - offset) {
+            space = PIPE_RING_SIZE - offset;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        size_t n;
+        int ret = DecompressSome(pipe, pipe->ring + offset, space, &n);
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->produced += n;
+        if (ret != 0) {
+            pipe->failed = (ret < 0);
+            break;
+        }
+        pthread_cond_broadcast(&pipe->cond);
     }
+    pipe->done = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+// Start decompressing ahead on a separate thread.  If that isn't
+// possible the pipe just stays synchronous.
+static void StartPatchPipe(PatchPipe* pipe) {
+    pipe->ring = malloc(PIPE_RING_SIZE);
+    if (pipe->ring == NULL) {
+        return;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+    pipe->produced = pipe->consumed = 0;
+    pipe->done = pipe->failed = pipe->stop = 0;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    if (pthread_create(&pipe->thread, NULL, PatchPipeThread, pipe) != 0) {
+        pthread_mutex_destroy(&pipe->lock);
+        pthread_cond_destroy(&pipe->cond);
+        free(pipe->ring);
+        pipe->ring = NULL;
     }
-    free(new_data);
+}
 
+static void StopPatchPipe(PatchPipe* pipe) {
+    if (pipe->ring == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pipe->lock);
+    pipe->stop = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    pthread_join(pipe->thread, NULL);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->cond);
+    free(pipe->ring);
+    pipe->ring = NULL;
+}
+
+// Read exactly 'size' decompressed bytes from the pipe.  Returns 0 on
+// success.
+static int ReadPatchPipe(PatchPipe* pipe, unsigned char* buffer, size_t size) {
+    if (pipe->ring == NULL) {
+        return FillBuffer(buffer, size, pipe);
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    while (size > 0) {
+        size_t avail = pipe->produced - pipe->consumed;
+        if (avail == 0) {
+            if (pipe->done) {
+                if (!pipe->failed) {
+                    printf("need %ld more bytes\n", (long)size);
+                }
+                pthread_mutex_unlock(&pipe->lock);
+                return -1;
+            }
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+            continue;
+        }
+
+        // The filled region can't change under us, so copy it out
+        // without the lock.
+        size_t offset = pipe->consumed % PIPE_RING_SIZE;
+        size_t n = avail;
+        if (n > PIPE_RING_SIZE - offset) n = PIPE_RING_SIZE - offset;
+        if (n > size) n = size;
+        pthread_mutex_unlock(&pipe->lock);
+
+        memcpy(buffer, pipe->ring + offset, n);
+        buffer += n;
+        size -= n;
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->consumed += n;
+        pthread_cond_broadcast(&pipe->cond);
+    }
+    pthread_mutex_unlock(&pipe->lock);
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+static int InitPatchPipe(PatchPipe* pipe, int use_zlib, char* data,
+                         ssize_t len, const char* name) {
+    int ret;
+
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->name = name;
+    pipe->use_zlib = use_zlib;
+    if (use_zlib) {
+        pipe->z.next_in = (unsigned char*)data;
+        pipe->z.avail_in = len;
+        ret = inflateInit(&pipe->z);
+        if (ret != Z_OK) {
+            printf("failed to init inflation of %s stream (%d)\n", name, ret);
+            return -1;
+        }
+    } else {
+        pipe->bz.next_in = data;
+        pipe->bz.avail_in = len;
+        ret = BZ2_bzDecompressInit(&pipe->bz, 0, 0);
+        if (ret != BZ_OK) {
+            printf("failed to bzinit %s stream (%d)\n", name, ret);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void EndPatchPipe(PatchPipe* pipe) {
+    StopPatchPipe(pipe);
+    if (pipe->use_zlib) {
+        inflateEnd(&pipe->z);
+    } else {
+        BZ2_bzDecompressEnd(&pipe->bz);
+    }
+}
+
+// Parse the header of the BSDIFF40 or BSDIFFZ1 patch at patch_offset
+// in patch and set up decompression of its three streams.  Returns 0
+// on success; the caller must then call CloseBSDiffStreams().
+static int OpenBSDiffStreams(const Value* patch, ssize_t patch_offset,
+                             BSDiffStreams* s) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -134,9 +352,21 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // with control block a set of triples (x,y,z) meaning "add x bytes
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
+    //
+    // A "BSDIFFZ1" patch is laid out identically, but its three blocks
+    // are zlib streams, which decode several times faster than bzip2.
 
+    if (patch_offset < 0 || patch_offset + 32 > patch->size) {
+        printf("patch too short to contain bsdiff header\n");
+        return 1;
+    }
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
+    int use_zlib;
+    if (memcmp(header, "BSDIFF40", 8) == 0) {
+        use_zlib = 0;
+    } else if (memcmp(header, "BSDIFFZ1", 8) == 0) {
+        use_zlib = 1;
+    } else {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
@@ -144,60 +374,120 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     ssize_t ctrl_len, data_len;
     ctrl_len = offtin(header+8);
     data_len = offtin(header+16);
-    *new_size = offtin(header+24);
+    s->new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (ctrl_len < 0 || data_len < 0 || s->new_size < 0 ||
+        patch_offset + 32 + ctrl_len + data_len > patch->size) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
 
-    int bzerr;
+    char* ctrl_data = patch->data + patch_offset + 32;
+    if (InitPatchPipe(&s->ctrl, use_zlib, ctrl_data, ctrl_len,
+                      "control") != 0) {
+        return 1;
+    }
+    if (InitPatchPipe(&s->diff, use_zlib, ctrl_data + ctrl_len, data_len,
+                      "diff") != 0) {
+        EndPatchPipe(&s->ctrl);
+        return 1;
+    }
+    if (InitPatchPipe(&s->extra, use_zlib, ctrl_data + ctrl_len + data_len,
+                      patch->size - (patch_offset + 32 + ctrl_len + data_len),
+                      "extra") != 0) {
+        EndPatchPipe(&s->ctrl);
+        EndPatchPipe(&s->diff);
+        return 1;
+    }
 
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+    // Decoding dominates patching time, so on multi-core devices
+    // decode all three streams concurrently with the combining loop.
+    // Small outputs aren't worth the thread startup.
+    if (s->new_size >= PIPE_RING_SIZE &&
+        sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        StartPatchPipe(&s->ctrl);
+        StartPatchPipe(&s->diff);
+        StartPatchPipe(&s->extra);
     }
+    return 0;
+}
+
+static void CloseBSDiffStreams(BSDiffStreams* s) {
+    EndPatchPipe(&s->ctrl);
+    EndPatchPipe(&s->diff);
+    EndPatchPipe(&s->extra);
+}
 
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+// dst[i] += src[i] for i in [0, len).
+static void AddBytes(unsigned char* dst, const unsigned char* src,
+                     size_t len) {
+    size_t i = 0;
+#if defined(__ARM_NEON__)
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(dst + i, vaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i o = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(d, o));
     }
+#endif
+    for (; i < len; ++i) {
+        dst[i] += src[i];
+    }
+}
 
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
+// Add len bytes of old data, starting at oldpos, to the diff bytes
+// in dst.  Positions outside the old data contribute nothing; the
+// bounds are worked out once so the add itself is a straight run.
+static void AddOldData(unsigned char* dst, off_t len,
+                       const unsigned char* old_data, ssize_t old_size,
+                       off_t oldpos) {
+    off_t start = 0, end = len;
+    if (oldpos < 0) {
+        start = -oldpos;
     }
+    if (oldpos + end > old_size) {
+        end = old_size - oldpos;
+    }
+    if (start < end) {
+        AddBytes(dst + start, old_data + oldpos + start, end - start);
+    }
+}
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
+// Hand the first 'len' bytes of the window to the sink and the SHA
+// context (either of which may be NULL).
+static int FlushWindow(unsigned char* window, size_t len,
+                       SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (len == 0) {
+        return 0;
+    }
+    if (sink != NULL && sink(window, len, token) < (ssize_t)len) {
+        printf("short write of output: %d (%s)\n", errno, strerror(errno));
         return 1;
     }
+    if (ctx) {
+        SHA_update(ctx, window, len);
+    }
+    return 0;
+}
 
+// Run the control triples of an opened patch, producing the output
+// in window_size pieces.  Each time the window fills it is flushed
+// to the sink and SHA context, so memory use is bounded by
+// window_size rather than by the target size.
+static int ApplyBSDiffStreams(const unsigned char* old_data, ssize_t old_size,
+                              BSDiffStreams* s,
+                              unsigned char* window, size_t window_size,
+                              SinkFn sink, void* token, SHA_CTX* ctx) {
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
+    size_t filled = 0;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < s->new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (ReadPatchPipe(&s->ctrl, buf, 24) != 0) {
             printf("error while reading control stream\n");
             return 1;
         }
@@ -206,47 +496,129 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            newpos + ctrl[0] > s->new_size) {
             printf("corrupt patch (new file overrun)\n");
             return 1;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
-
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read diff string and add old data to it
+        off_t left = ctrl[0];
+        while (left > 0) {
+            if (filled == window_size) {
+                if (FlushWindow(window, filled, sink, token, ctx) != 0) {
+                    return 1;
+                }
+                filled = 0;
             }
+            size_t n = window_size - filled;
+            if ((off_t)n > left) n = left;
+            if (ReadPatchPipe(&s->diff, window + filled, n) != 0) {
+                printf("error while reading diff stream\n");
+                return 1;
+            }
+            AddOldData(window + filled, n, old_data, old_size, oldpos);
+            filled += n;
+            oldpos += n;
+            newpos += n;
+            left -= n;
         }
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
-
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (newpos + ctrl[1] > s->new_size) {
             printf("corrupt patch (new file overrun)\n");
             return 1;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        left = ctrl[1];
+        while (left > 0) {
+            if (filled == window_size) {
+                if (FlushWindow(window, filled, sink, token, ctx) != 0) {
+                    return 1;
+                }
+                filled = 0;
+            }
+            size_t n = window_size - filled;
+            if ((off_t)n > left) n = left;
+            if (ReadPatchPipe(&s->extra, window + filled, n) != 0) {
+                printf("error while reading extra stream\n");
+                return 1;
+            }
+            filled += n;
+            newpos += n;
+            left -= n;
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
-    return 0;
+    return FlushWindow(window, filled, sink, token, ctx);
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    return ApplyBSDiffPatchWindowed(old_data, old_size, patch, patch_offset,
+                                    sink, token, ctx, BSPATCH_WINDOW_SIZE);
+}
+
+int ApplyBSDiffPatchWindowed(const unsigned char* old_data, ssize_t old_size,
+                             const Value* patch, ssize_t patch_offset,
+                             SinkFn sink, void* token, SHA_CTX* ctx,
+                             size_t window_size) {
+    BSDiffStreams s;
+    if (OpenBSDiffStreams(patch, patch_offset, &s) != 0) {
+        return -1;
+    }
+
+    // No point in a window bigger than the whole output.
+    if (window_size == 0) {
+        window_size = BSPATCH_WINDOW_SIZE;
+    }
+    if ((ssize_t)window_size > s.new_size) {
+        window_size = s.new_size > 0 ? s.new_size : 1;
+    }
+    unsigned char* window = malloc(window_size);
+    if (window == NULL) {
+        printf("failed to allocate %ld byte bspatch window\n",
+               (long)window_size);
+        CloseBSDiffStreams(&s);
+        return -1;
+    }
+
+    int result = ApplyBSDiffStreams(old_data, old_size, &s,
+                                    window, window_size, sink, token, ctx);
+    free(window);
+    CloseBSDiffStreams(&s);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    BSDiffStreams s;
+    if (OpenBSDiffStreams(patch, patch_offset, &s) != 0) {
+        return 1;
+    }
+    *new_size = s.new_size;
+
+    *new_data = malloc(*new_size > 0 ? *new_size : 1);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        CloseBSDiffStreams(&s);
+        return 1;
+    }
+
+    // The whole output is one window, and there's nowhere to flush it.
+    int result = ApplyBSDiffStreams(old_data, old_size, &s,
+                                    *new_data, *new_size, NULL, NULL, NULL);
+    CloseBSDiffStreams(&s);
+    if (result != 0) {
+        free(*new_data);
+        *new_data = NULL;
+    }
+    return result;
 }
@@ -5,13 +5,29 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <ctype.h>
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+// Every /cache file some process has open, sorted for bsearch().
+// Walking /proc/*/fd is by far the slowest part of freeing space, so
+// it's done once and kept for the life of the process: during an
+// install the only processes are recovery and the updater, and they
+// have opened what they need from /cache before the first check.
+static char** open_files = NULL;
+static int open_file_count = 0;
+static int open_files_indexed = 0;
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int IndexOpenFiles() {
+  if (open_files_indexed) return 0;
+
   DIR* d;
   struct dirent* de;
   d = opendir("/proc");
@@ -19,6 +35,9 @@ static int EliminateOpenFiles(char** files, int file_count) {
     printf("error opening /proc: %s\n", strerror(errno));
     return -1;
   }
+  int size = 32;
+  open_files = malloc(size * sizeof(char*));
+  open_file_count = 0;
   while ((de = readdir(d)) != 0) {
     int i;
     for (i = 0; de->d_name[i] != '\0' && isdigit(de->d_name[i]); ++i);
@@ -48,19 +67,13 @@ static int EliminateOpenFiles(char** files, int file_count) {
       count = readlink(fd_path, link, sizeof(link)-1);
       if (count >= 0) {
         link[count] = '\0';
-
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
         if (strncmp(link, "/cache/", 7) == 0) {
-          int j;
-          for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
-              printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
-            }
+          printf("%s is open by %s\n", link, de->d_name);
+          if (open_file_count >= size) {
+            size *= 2;
+            open_files = realloc(open_files, size * sizeof(char*));
           }
+          open_files[open_file_count++] = strdup(link);
         }
       }
     }
@@ -68,15 +81,51 @@ static int EliminateOpenFiles(char** files, int file_count) {
   }
   closedir(d);
 
+  qsort(open_files, open_file_count, sizeof(char*), compare_names);
+  open_files_indexed = 1;
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+static int IsOpen(const char* path) {
+  return bsearch(&path, open_files, open_file_count, sizeof(char*),
+                 compare_names) != NULL;
+}
+
+typedef struct {
+  char* name;
+  size_t size;     // space freed by deleting it
+  time_t mtime;
+} Expendable;
+
+static CacheEvictPolicy sort_policy;
+
+static int compare_expendable(const void* a, const void* b) {
+  const Expendable* ea = (const Expendable*)a;
+  const Expendable* eb = (const Expendable*)b;
+  if (sort_policy == CACHE_EVICT_OLDEST && ea->mtime != eb->mtime) {
+    return ea->mtime < eb->mtime ? -1 : 1;
+  }
+  if (ea->size != eb->size) {
+    return ea->size > eb->size ? -1 : 1;
+  }
+  return strcmp(ea->name, eb->name);
+}
+
+// Find the unopened regular files we may delete, in the order
+// 'policy' says to delete them.  *total is the space deleting all of
+// them would free.
+static int FindExpendableFiles(Expendable** files, int* entries,
+                               size_t* total, CacheEvictPolicy policy) {
   DIR* d;
   struct dirent* de;
   int size = 32;
   *entries = 0;
-  *names = malloc(size * sizeof(char*));
+  *total = 0;
+  *files = malloc(size * sizeof(Expendable));
+
+  if (IndexOpenFiles() < 0) {
+    return -1;
+  }
 
   char path[FILENAME_MAX];
 
@@ -98,34 +147,37 @@ int FindExpendableFiles(char*** names, int* entries) {
       strcat(path, "/");
       strcat(path, de->d_name);
 
-      // We can't delete CACHE_TEMP_SOURCE; if it's there we might have
-      // restarted during installation and could be depending on it to
-      // be there.
+      // We can't delete CACHE_TEMP_SOURCE (or its journal); if it's
+      // there we might have restarted during installation and could be
+      // depending on it to be there.
       if (strcmp(path, CACHE_TEMP_SOURCE) == 0) continue;
+      if (strcmp(path, CACHE_TEMP_JOURNAL) == 0) continue;
 
       struct stat st;
-      if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && !IsOpen(path)) {
         if (*entries >= size) {
           size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
+          *files = realloc(*files, size * sizeof(Expendable));
         }
-        (*names)[(*entries)++] = strdup(path);
+        Expendable* e = *files + (*entries)++;
+        e->name = strdup(path);
+        e->size = (size_t)st.st_blocks * 512;
+        e->mtime = st.st_mtime;
+        *total += e->size;
       }
     }
 
     closedir(d);
   }
 
-  printf("%d regular files in deletable directories\n", *entries);
-
-  if (EliminateOpenFiles(*names, *entries) < 0) {
-    return -1;
-  }
+  printf("%d unopened regular files in deletable directories\n", *entries);
 
+  sort_policy = policy;
+  qsort(*files, *entries, sizeof(Expendable), compare_expendable);
   return 0;
 }
 
-int MakeFreeSpaceOnCache(size_t bytes_needed) {
+static int MakeFreeSpace(size_t bytes_needed, CacheEvictPolicy policy) {
   size_t free_now = FreeSpaceForFile("/cache");
   printf("%ld bytes free on /cache (%ld needed)\n",
          (long)free_now, (long)bytes_needed);
@@ -134,39 +186,62 @@ int MakeFreeSpaceOnCache(size_t bytes_needed) {
     return 0;
   }
 
-  char** names;
+  Expendable* files;
   int entries;
+  size_t total;
 
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  if (FindExpendableFiles(&files, &entries, &total, policy) < 0) {
+    free(files);
     return -1;
   }
 
+  int i;
+  int result = -1;
   if (entries == 0) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
-    return -1;
-  }
-
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
-
-  int i;
-  for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
+  } else if (free_now + total < bytes_needed) {
+    // Don't delete anything if it wouldn't be enough anyway.
+    printf("deleting every expendable file would only free %ld bytes\n",
+           (long)total);
+  } else {
+    size_t expected = free_now;
+    for (i = 0; i < entries && expected < bytes_needed; ++i) {
+      if (unlink(files[i].name) == 0) {
+        expected += files[i].size;
+        printf("deleted %s (%ld bytes)\n", files[i].name, (long)files[i].size);
+      } else {
+        printf("failed to delete %s: %s\n", files[i].name, strerror(errno));
+      }
     }
+    free_now = FreeSpaceForFile("/cache");
+    printf("now %ld bytes free\n", (long)free_now);
+    result = (free_now >= bytes_needed) ? 0 : -1;
   }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+  for (i = 0; i < entries; ++i) {
+    free(files[i].name);
   }
-  free(names);
+  free(files);
+  return result;
+}
+
+int MakeFreeSpaceOnCache(size_t bytes_needed) {
+  return MakeFreeSpace(bytes_needed, CACHE_EVICT_LARGEST);
+}
 
-  return (free_now >= bytes_needed) ? 0 : -1;
+// Make room on /cache for a whole sequence of patches up front.  Each
+// step reuses CACHE_TEMP_SOURCE, so what matters is the largest one;
+// once it fits, the per-file MakeFreeSpaceOnCache() calls made while
+// patching find enough space without deleting (or scanning) anything.
+int PlanCacheSpace(int count, const size_t* bytes_needed,
+                   CacheEvictPolicy policy) {
+  size_t peak = 0;
+  int i;
+  for (i = 0; i < count; ++i) {
+    if (bytes_needed[i] > peak) peak = bytes_needed[i];
+  }
+  printf("peak /cache requirement of %d steps is %ld bytes\n",
+         count, (long)peak);
+  return MakeFreeSpace(peak, policy);
 }
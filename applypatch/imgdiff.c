@@ -64,7 +64,7 @@
  *    "IMGDIFF1"                  (8)   [magic number and version]
  *    chunk count                 (4)
  *    for each chunk:
- *        chunk type              (4)   [CHUNK_{NORMAL, GZIP, DEFLATE, RAW}]
+ *        chunk type              (4)   [CHUNK_{NORMAL, GZIP, DEFLATE, RAW, LZ4}]
  *        if chunk type == CHUNK_NORMAL:
  *           source start         (8)
  *           source len           (8)
@@ -97,6 +97,13 @@
  *        if chunk type == RAW:             (version 2 only)
  *           target len           (4)
  *           data                 (target len)
+ *        if chunk type == CHUNK_LZ4:       (version 2 only)
+ *           source start         (8)
+ *           source len           (8)
+ *           bsdiff patch offset  (8)   [from start of patch file]
+ *           source expanded len  (8)   [size of uncompressed source]
+ *           target expected len  (8)   [size of uncompressed target]
+ *           lz4 level            (4)
  *
  * All integers are little-endian.  "source start" and "source len"
  * specify the section of the input image that comprises this chunk,
@@ -111,6 +118,32 @@
  *
  * After the header there are 'chunk count' bsdiff patches; the offset
  * of each from the beginning of the file is specified in the header.
+ * The patch ends with a table of the SHA-1 of each chunk's output:
+ *
+ *    "IMGDSHA1"                  (8)
+ *    for each chunk:
+ *        target sha1             (20)  [of the bytes the chunk writes]
+ *
+ * so that applypatch can check each chunk as it goes, stopping at the
+ * first bad one, rather than only the whole target at the end.  Older versions of
+ * applypatch don't read past the last bsdiff patch and ignore it.
+ * With -Z these are BSDIFFZ1 (zlib-compressed) rather than BSDIFF40
+ * (bzip2) patches, which applypatch decodes much faster at the cost
+ * of a slightly bigger patch.
+ *
+ * With -l (and when built with USE_LZ4), LZ4 legacy frames -- what
+ * "lz4 -l" writes, and what LZ4-compressed kernels and ramdisks use --
+ * are found by their magic number and become CHUNK_LZ4 chunks, which
+ * are expanded, patched and recompressed much like deflate chunks.
+ * The frame header holds no encoder parameters, so the level is found
+ * by recompressing the target with each one until the output matches.
+ * Patches with LZ4 chunks need an applypatch that knows about them, so
+ * this is off by default.  (XZ streams are left as normal chunks: the
+ * device has no XZ encoder to reproduce them with.)
+ *
+ * With -c, the suffix array of each source chunk is kept in the given
+ * directory (named by the SHA-1 of the chunk data) and reused by
+ * later runs against the same source.
  *
  * This tool can take an optional file of "bonus data".  This is an
  * extra file of data that is appended to chunk #1 after it is
@@ -122,19 +155,26 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
 
 #include "zlib.h"
 #include "imgdiff.h"
+#include "lz4chunk.h"
+#include "mincrypt/sha.h"
 #include "utils.h"
 
+struct SuffixArray;     // from bsdiff.c
+
 typedef struct {
-  int type;             // CHUNK_NORMAL, CHUNK_DEFLATE
+  int type;             // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_LZ4
   size_t start;         // offset of chunk in original image file
 
   size_t len;
@@ -143,20 +183,22 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  struct SuffixArray* I;  // used by bsdiff
 
-  // --- for CHUNK_DEFLATE chunks only: ---
+  // --- for CHUNK_DEFLATE and CHUNK_LZ4 chunks only: ---
 
-  // original (compressed) deflate data
+  // original (compressed) deflate data, or the whole LZ4 frame
   size_t deflate_len;
   unsigned char* deflate_data;
 
   char* filename;       // used for zip entries
 
-  // deflate encoder parameters
+  // deflate encoder parameters (only the level, for LZ4)
   int level, method, windowBits, memLevel, strategy;
 
   size_t source_uncompressed_len;
+
+  uint8_t digest[SHA_DIGEST_SIZE];  // of the chunk's output; see MakePatches()
 } ImageChunk;
 
 typedef struct {
@@ -179,31 +221,180 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
+struct SuffixArray* load_suffix_array(u_char* old, off_t oldsize,
+                                      const char* cache_dir);
+void free_suffix_array(struct SuffixArray* sa);
+int bsdiff_mem(u_char* old, off_t oldsize, struct SuffixArray** IP,
+               u_char* new, off_t newsize,
+               u_char** patch, size_t* patch_size, int use_zlib);
+
+// Set by -Z: compress the per-chunk bsdiff patches with zlib
+// (BSDIFFZ1) rather than bzip2 (BSDIFF40).
+static int use_zlib = 0;
+
+// Set by -c: directory in which to keep the suffix arrays of source
+// chunks, so diffing the same source again doesn't have to sort it.
+static const char* sa_cache_dir = NULL;
+
+#ifdef USE_LZ4
+// Set by -l: find LZ4 legacy frames in images and patch them as
+// CHUNK_LZ4 chunks.
+static int use_lz4 = 0;
+
+static int IsLz4Frame(const unsigned char* p, size_t len) {
+  return use_lz4 && len >= 4 && Read4(p) == LZ4_LEGACY_MAGIC;
+}
+#else
+static int IsLz4Frame(const unsigned char* p, size_t len) {
+  return 0;
+}
+#endif
 
-unsigned char* ReadZip(const char* filename,
-                       int* num_chunks, ImageChunk** chunks,
-                       int include_pseudo_chunk) {
+/*
+ * Map the given file read-only, so that chunking a large image
+ * doesn't first copy all of it into memory (the kernel can drop and
+ * re-read pages of a mapping, which it can't do with a malloc'd
+ * copy).  Files that can't be mapped are read instead.  Returns NULL
+ * on failure.
+ */
+static unsigned char* MapInput(const char* filename, size_t* size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+    return NULL;
+  }
   struct stat st;
-  if (stat(filename, &st) != 0) {
+  if (fstat(fd, &st) != 0) {
     printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+    close(fd);
     return NULL;
   }
+  *size = st.st_size;
 
-  unsigned char* img = malloc(st.st_size);
-  FILE* f = fopen(filename, "rb");
-  if (fread(img, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read \"%s\" %s\n", filename, strerror(errno));
-    fclose(f);
+  unsigned char* data = NULL;
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      data = NULL;
+    }
+  }
+  if (data == NULL) {
+    data = malloc(st.st_size > 0 ? st.st_size : 1);
+    size_t done = 0;
+    while (data != NULL && done < *size) {
+      ssize_t n = read(fd, data + done, *size - done);
+      if (n <= 0) {
+        printf("failed to read \"%s\": %s\n", filename,
+               n < 0 ? strerror(errno) : "short read");
+        free(data);
+        data = NULL;
+        break;
+      }
+      done += n;
+    }
+  }
+  close(fd);
+  return data;
+}
+
+// zlib's counts are 32 bits, so inflate() is handed at most this
+// much input or output space at a time.
+#define INFLATE_WINDOW (1u << 30)
+
+/*
+ * Inflate the raw deflate stream at the start of the 'avail' bytes at
+ * 'in' into a malloc'd chunk->data and chunk->len, and set
+ * chunk->deflate_len to the length of the stream.  'expected' is the
+ * inflated size if it's known (from a zip directory), in which case
+ * the output is allocated once.  Otherwise the buffer starts at 1MB
+ * and doubles -- glibc remaps rather than copies blocks that big --
+ * and the slack is given back at the end.  Returns 0 on success.
+ */
+static int InflateChunk(ImageChunk* chunk, unsigned char* in, size_t avail,
+                        size_t expected) {
+  size_t allocated = expected > 0 ? expected : (1 << 20);
+  chunk->len = 0;
+  chunk->data = malloc(allocated);
+  if (chunk->data == NULL) {
+    printf("failed to allocate %zu bytes to inflate into\n", allocated);
+    return -1;
+  }
+
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = 0;
+  strm.next_in = Z_NULL;
+
+  // -15 means we are decoding a 'raw' deflate stream; zlib will
+  // not expect zlib headers.
+  int ret = inflateInit2(&strm, -15);
+  if (ret != Z_OK) {
+    printf("failed to init inflation: %d\n", ret);
+    free(chunk->data);
+    chunk->data = NULL;
+    return -1;
+  }
+
+  size_t consumed = 0;
+  do {
+    if (chunk->len == allocated) {
+      unsigned char* grown = realloc(chunk->data, allocated * 2);
+      if (grown == NULL) {
+        printf("failed to allocate %zu bytes to inflate into\n",
+               allocated * 2);
+        ret = Z_MEM_ERROR;
+        break;
+      }
+      chunk->data = grown;
+      allocated *= 2;
+    }
+    size_t in_now = avail - consumed;
+    if (in_now > INFLATE_WINDOW) in_now = INFLATE_WINDOW;
+    size_t out_now = allocated - chunk->len;
+    if (out_now > INFLATE_WINDOW) out_now = INFLATE_WINDOW;
+
+    strm.next_in = in + consumed;
+    strm.avail_in = in_now;
+    strm.next_out = chunk->data + chunk->len;
+    strm.avail_out = out_now;
+    ret = inflate(&strm, Z_NO_FLUSH);
+    consumed += in_now - strm.avail_in;
+    chunk->len += out_now - strm.avail_out;
+  } while (ret == Z_OK);
+  inflateEnd(&strm);
+
+  if (ret != Z_STREAM_END) {
+    printf("failed to inflate data at offset %zu: %d\n", chunk->start, ret);
+    free(chunk->data);
+    chunk->data = NULL;
+    return -1;
+  }
+  if (chunk->len < allocated) {
+    unsigned char* trimmed = realloc(chunk->data,
+                                     chunk->len > 0 ? chunk->len : 1);
+    if (trimmed != NULL) {
+      chunk->data = trimmed;
+    }
+  }
+  chunk->deflate_len = consumed;
+  return 0;
+}
+
+unsigned char* ReadZip(const char* filename,
+                       int* num_chunks, ImageChunk** chunks,
+                       int include_pseudo_chunk) {
+  size_t size;
+  unsigned char* img = MapInput(filename, &size);
+  if (img == NULL) {
     return NULL;
   }
-  fclose(f);
 
   // look for the end-of-central-directory record.
 
   int i;
-  for (i = st.st_size-20; i >= 0 && i > st.st_size - 65600; --i) {
+  for (i = (ssize_t)size-20; i >= 0 && i > (ssize_t)size - 65600; --i) {
     if (img[i] == 0x50 && img[i+1] == 0x4b &&
         img[i+2] == 0x05 && img[i+3] == 0x06) {
       break;
@@ -290,7 +481,7 @@ unsigned char* ReadZip(const char* filename,
   if (include_pseudo_chunk) {
     curr->type = CHUNK_NORMAL;
     curr->start = 0;
-    curr->len = st.st_size;
+    curr->len = size;
     curr->data = img;
     curr->filename = NULL;
     curr->I = NULL;
@@ -301,7 +492,7 @@ unsigned char* ReadZip(const char* filename,
   int pos = 0;
   int nextentry = 0;
 
-  while (pos < st.st_size) {
+  while (pos < size) {
     if (nextentry < entrycount && pos == temp_entries[nextentry].data_offset) {
       curr->type = CHUNK_DEFLATE;
       curr->start = pos;
@@ -310,29 +501,13 @@ unsigned char* ReadZip(const char* filename,
       curr->filename = temp_entries[nextentry].filename;
       curr->I = NULL;
 
-      curr->len = temp_entries[nextentry].uncomp_len;
-      curr->data = malloc(curr->len);
-
-      z_stream strm;
-      strm.zalloc = Z_NULL;
-      strm.zfree = Z_NULL;
-      strm.opaque = Z_NULL;
-      strm.avail_in = curr->deflate_len;
-      strm.next_in = curr->deflate_data;
-
-      // -15 means we are decoding a 'raw' deflate stream; zlib will
-      // not expect zlib headers.
-      int ret = inflateInit2(&strm, -15);
-
-      strm.avail_out = curr->len;
-      strm.next_out = curr->data;
-      ret = inflate(&strm, Z_NO_FLUSH);
-      if (ret != Z_STREAM_END) {
-        printf("failed to inflate \"%s\"; %d\n", curr->filename, ret);
+      if (InflateChunk(curr, curr->deflate_data, curr->deflate_len,
+                       temp_entries[nextentry].uncomp_len) != 0 ||
+          curr->len != temp_entries[nextentry].uncomp_len) {
+        printf("failed to inflate \"%s\"\n", curr->filename);
         return NULL;
       }
-
-      inflateEnd(&strm);
+      curr->deflate_len = temp_entries[nextentry].deflate_len;
 
       pos += curr->deflate_len;
       ++nextentry;
@@ -349,7 +524,7 @@ unsigned char* ReadZip(const char* filename,
     if (nextentry < entrycount) {
       curr->len = temp_entries[nextentry].data_offset - pos;
     } else {
-      curr->len = st.st_size - pos;
+      curr->len = size - pos;
     }
     curr->data = img + pos;
     curr->filename = NULL;
@@ -367,43 +542,31 @@ unsigned char* ReadZip(const char* filename,
 /*
  * Read the given file and break it up into chunks, putting the number
  * of chunks and their info in *num_chunks and **chunks,
- * respectively.  Returns a malloc'd block of memory containing the
- * contents of the file; various pointers in the output chunk array
- * will point into this block of memory.  The caller should free the
- * return value when done with all the chunks.  Returns NULL on
- * failure.
+ * respectively.  Returns the contents of the file (see MapInput());
+ * various pointers in the output chunk array will point into it, so
+ * it must stay around until the caller is done with all the chunks.
+ * Returns NULL on failure.
  */
 unsigned char* ReadImage(const char* filename,
                          int* num_chunks, ImageChunk** chunks) {
-  struct stat st;
-  if (stat(filename, &st) != 0) {
-    printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
-    return NULL;
-  }
-
-  unsigned char* img = malloc(st.st_size + 4);
-  FILE* f = fopen(filename, "rb");
-  if (fread(img, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read \"%s\" %s\n", filename, strerror(errno));
-    fclose(f);
+  size_t size;
+  unsigned char* img = MapInput(filename, &size);
+  if (img == NULL) {
     return NULL;
   }
-  fclose(f);
-
-  // append 4 zero bytes to the data so we can always search for the
-  // four-byte string 1f8b0800 starting at any point in the actual
-  // file data, without special-casing the end of the data.
-  memset(img+st.st_size, 0, 4);
 
   size_t pos = 0;
 
   *num_chunks = 0;
   *chunks = NULL;
 
-  while (pos < st.st_size) {
+  while (pos < size) {
     unsigned char* p = img+pos;
+    unsigned char* lz4_data = NULL;
+    size_t lz4_size = 0;
+    ssize_t lz4_len = -1;
 
-    if (st.st_size - pos >= 4 &&
+    if (size - pos >= GZIP_HEADER_LEN &&
         p[0] == 0x1f && p[1] == 0x8b &&
         p[2] == 0x08 &&    // deflate compression
         p[3] == 0x00) {    // no header flags
@@ -432,36 +595,13 @@ unsigned char* ReadImage(const char* filename,
       // ends, and so we can put the uncompressed data and its length
       // into curr->data and curr->len.
 
-      size_t allocated = 32768;
-      curr->len = 0;
-      curr->data = malloc(allocated);
       curr->start = pos;
       curr->deflate_data = p;
-
-      z_stream strm;
-      strm.zalloc = Z_NULL;
-      strm.zfree = Z_NULL;
-      strm.opaque = Z_NULL;
-      strm.avail_in = st.st_size - pos;
-      strm.next_in = p;
-
-      // -15 means we are decoding a 'raw' deflate stream; zlib will
-      // not expect zlib headers.
-      int ret = inflateInit2(&strm, -15);
-
-      do {
-        strm.avail_out = allocated - curr->len;
-        strm.next_out = curr->data + curr->len;
-        ret = inflate(&strm, Z_NO_FLUSH);
-        curr->len = allocated - strm.avail_out;
-        if (strm.avail_out == 0) {
-          allocated *= 2;
-          curr->data = realloc(curr->data, allocated);
-        }
-      } while (ret != Z_STREAM_END);
-
-      curr->deflate_len = st.st_size - strm.avail_in - pos;
-      inflateEnd(&strm);
+      if (InflateChunk(curr, p, size - pos, 0) != 0 ||
+          size - pos - curr->deflate_len < GZIP_FOOTER_LEN) {
+        printf("bad gzip data at offset %zu\n", curr->start);
+        return NULL;
+      }
       pos += curr->deflate_len;
       p += curr->deflate_len;
       ++curr;
@@ -486,9 +626,25 @@ unsigned char* ReadImage(const char* filename,
       if (footer_size != curr[-2].len) {
         printf("Error: footer size %d != decompressed size %d\n",
                 footer_size, curr[-2].len);
-        free(img);
         return NULL;
       }
+    } else if (IsLz4Frame(p, size - pos) &&
+               (lz4_len = Lz4LegacyDecompress(p, size - pos,
+                                              &lz4_data, &lz4_size)) > 0) {
+      // 'pos' is the start of an LZ4 frame.  Unlike gzip there's no
+      // separate header or footer; the chunk is the whole frame.
+      ++*num_chunks;
+      *chunks = realloc(*chunks, *num_chunks * sizeof(ImageChunk));
+      ImageChunk* curr = *chunks + (*num_chunks-1);
+      curr->type = CHUNK_LZ4;
+      curr->start = pos;
+      curr->filename = NULL;
+      curr->I = NULL;
+      curr->data = lz4_data;
+      curr->len = lz4_size;
+      curr->deflate_data = p;
+      curr->deflate_len = lz4_len;
+      pos += lz4_len;
     } else {
       // Reallocate the list for every chunk; we expect the number of
       // chunks to be small (5 for typical boot and recovery images).
@@ -499,17 +655,23 @@ unsigned char* ReadImage(const char* filename,
       curr->I = NULL;
 
       // 'pos' is not the offset of the start of a gzip chunk, so scan
-      // forward until we find a gzip header.
+      // forward until we find a gzip header (or an LZ4 frame; one
+      // that didn't decompress at 'pos' itself is just data).
       curr->type = CHUNK_NORMAL;
       curr->data = p;
 
-      for (curr->len = 0; curr->len < (st.st_size - pos); ++curr->len) {
-        if (p[curr->len] == 0x1f &&
+      for (curr->len = 0; curr->len < (size - pos); ++curr->len) {
+        if (size - pos - curr->len >= GZIP_HEADER_LEN &&
+            p[curr->len] == 0x1f &&
             p[curr->len+1] == 0x8b &&
             p[curr->len+2] == 0x08 &&
             p[curr->len+3] == 0x00) {
           break;
         }
+        if (curr->len > 0 &&
+            IsLz4Frame(p+curr->len, size - pos - curr->len)) {
+          break;
+        }
       }
       pos += curr->len;
     }
@@ -520,19 +682,27 @@ unsigned char* ReadImage(const char* filename,
 
 #define BUFFER_SIZE 32768
 
+// One combination of deflate encoder parameters.  (The method is
+// always Z_DEFLATED.)
+typedef struct {
+  int level, windowBits, memLevel, strategy;
+} DeflateParams;
+
 /*
  * Takes the uncompressed data stored in the chunk, compresses it
- * using the zlib parameters stored in the chunk, and checks that it
- * matches exactly the compressed data we started with (also stored in
- * the chunk).  Return 0 on success.
+ * using the given zlib parameters, and checks that it matches exactly
+ * the compressed data we started with (also stored in the chunk).
+ * Gives up at the first block of output that differs.  Return 0 on
+ * success.
  */
-int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
+int TryReconstruction(const ImageChunk* chunk, const DeflateParams* params,
+                      unsigned char* out) {
   size_t p = 0;
 
 #if 0
-  printf("trying %d %d %d %d %d\n",
-          chunk->level, chunk->method, chunk->windowBits,
-          chunk->memLevel, chunk->strategy);
+  printf("trying %d %d %d %d\n",
+          params->level, params->windowBits,
+          params->memLevel, params->strategy);
 #endif
 
   z_stream strm;
@@ -542,15 +712,19 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
   strm.avail_in = chunk->len;
   strm.next_in = chunk->data;
   int ret;
-  ret = deflateInit2(&strm, chunk->level, chunk->method, chunk->windowBits,
-                     chunk->memLevel, chunk->strategy);
+  ret = deflateInit2(&strm, params->level, Z_DEFLATED, params->windowBits,
+                     params->memLevel, params->strategy);
+  if (ret != Z_OK) {
+    return -1;
+  }
   do {
     strm.avail_out = BUFFER_SIZE;
     strm.next_out = out;
     ret = deflate(&strm, Z_FINISH);
     size_t have = BUFFER_SIZE - strm.avail_out;
 
-    if (memcmp(out, chunk->deflate_data+p, have) != 0) {
+    if (p + have > chunk->deflate_len ||
+        memcmp(out, chunk->deflate_data+p, have) != 0) {
       // mismatch; data isn't the same.
       deflateEnd(&strm);
       return -1;
@@ -565,6 +739,137 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
   return 0;
 }
 
+// Encoder parameters that have reproduced chunks of this image so
+// far, most recently successful first.  Entries in a zip or the
+// pieces of a boot image are nearly always compressed the same way,
+// so these are tried before anything else.
+#define MAX_KNOWN_PARAMS 8
+static DeflateParams known_params[MAX_KNOWN_PARAMS];
+static int num_known_params = 0;
+
+static void RememberParams(const DeflateParams* params) {
+  int i;
+  for (i = 0; i < num_known_params; ++i) {
+    if (memcmp(known_params+i, params, sizeof(DeflateParams)) == 0) break;
+  }
+  if (i == num_known_params && num_known_params < MAX_KNOWN_PARAMS) {
+    ++num_known_params;
+  }
+  if (i == MAX_KNOWN_PARAMS) --i;
+  memmove(known_params+1, known_params, i * sizeof(DeflateParams));
+  known_params[0] = *params;
+}
+
+/*
+ * Fill 'list' with every encoder parameter combination zlib accepts
+ * for raw deflate streams, the likeliest ones first: the defaults at
+ * level 6 (what minigzip and most zip tools use) and level 9, then
+ * the other levels, then the other strategies, memLevels and
+ * windows.  Returns the number of entries.
+ */
+static int EnumerateParams(DeflateParams* list) {
+  static const int strategies[] = {
+    Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED
+  };
+  static const int level_order[] = { 6, 9, 1, 2, 3, 4, 5, 7, 8, 0 };
+  static const int memlevel_order[] = { 8, 9, 7, 6, 5, 4, 3, 2, 1 };
+  int n = 0;
+  int pass, s, l, w, m;
+
+  // pass 0 has the default window, memLevel and strategy; pass 1 is
+  // everything else.
+  for (pass = 0; pass < 2; ++pass) {
+    for (w = -15; w <= -9; ++w) {
+      for (m = 0; m < sizeof(memlevel_order) / sizeof(memlevel_order[0]); ++m) {
+        for (s = 0; s < sizeof(strategies) / sizeof(strategies[0]); ++s) {
+          int is_default = (s == 0 && w == -15 && m == 0);
+          if (is_default != (pass == 0)) continue;
+          for (l = 0; l < sizeof(level_order) / sizeof(level_order[0]); ++l) {
+            list[n].level = level_order[l];
+            list[n].windowBits = w;
+            list[n].memLevel = memlevel_order[m];
+            list[n].strategy = strategies[s];
+            ++n;
+          }
+        }
+      }
+    }
+  }
+  return n;
+}
+
+// 10 levels x 7 windows x 9 memLevels x 5 strategies.
+#define MAX_DEFLATE_PARAMS (10 * 7 * 9 * 5)
+
+typedef struct {
+  const ImageChunk* chunk;
+  const DeflateParams* candidates;
+  int num_candidates;
+  int next;           // next candidate to hand out
+  int found;          // lowest index known to match, or num_candidates
+  pthread_mutex_t lock;
+} ParamSearch;
+
+static void* ParamSearchThread(void* cookie) {
+  ParamSearch* search = (ParamSearch*)cookie;
+  unsigned char* out = malloc(BUFFER_SIZE);
+  if (out == NULL) return NULL;
+
+  pthread_mutex_lock(&search->lock);
+  // Candidates are handed out in order, so once one matches there's
+  // no point trying any later ones.
+  while (search->next < search->found) {
+    int i = search->next++;
+    pthread_mutex_unlock(&search->lock);
+    int ok = TryReconstruction(search->chunk, search->candidates+i, out) == 0;
+    pthread_mutex_lock(&search->lock);
+    if (ok && i < search->found) {
+      search->found = i;
+    }
+  }
+  pthread_mutex_unlock(&search->lock);
+  free(out);
+  return NULL;
+}
+
+/*
+ * Try each of the candidate parameter sets on the chunk, using all
+ * available cores.  Returns the index of the first candidate in the
+ * list that reproduces the chunk (so the answer doesn't depend on
+ * thread timing), or -1 if none does.
+ */
+static int SearchParams(const ImageChunk* chunk,
+                        const DeflateParams* candidates, int num_candidates) {
+  ParamSearch search;
+  search.chunk = chunk;
+  search.candidates = candidates;
+  search.num_candidates = num_candidates;
+  search.next = 0;
+  search.found = num_candidates;
+  pthread_mutex_init(&search.lock, NULL);
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > num_candidates) num_threads = num_candidates;
+
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int started = 0;
+  while (threads != NULL && started < num_threads-1 &&
+         pthread_create(threads+started, NULL, ParamSearchThread,
+                        &search) == 0) {
+    ++started;
+  }
+  ParamSearchThread(&search);
+  int i;
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&search.lock);
+
+  return search.found < num_candidates ? search.found : -1;
+}
+
 /*
  * Verify that we can reproduce exactly the same compressed data that
  * we started with.  Sets the level, method, windowBits, memLevel, and
@@ -577,82 +882,228 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
     return -1;
   }
 
-  size_t p = 0;
+  static DeflateParams all_params[MAX_DEFLATE_PARAMS];
+  static int num_all_params = 0;
+  if (num_all_params == 0) {
+    num_all_params = EnumerateParams(all_params);
+  }
+
+  DeflateParams params;
   unsigned char* out = malloc(BUFFER_SIZE);
+  int i, found = -1;
+
+  // Parameters that worked for earlier chunks nearly always work
+  // again, and a single try is cheap, so don't start threads for
+  // those.
+  for (i = 0; i < num_known_params; ++i) {
+    if (TryReconstruction(chunk, known_params+i, out) == 0) {
+      params = known_params[i];
+      found = i;
+      break;
+    }
+  }
+  free(out);
+
+  if (found < 0) {
+    // Level 0 only writes stored blocks and Z_FIXED only fixed-code
+    // ones, so if the stream opens with a dynamic block (BTYPE 10)
+    // neither can have produced it.
+    DeflateParams* candidates = all_params;
+    int num_candidates = num_all_params;
+    DeflateParams* filtered = NULL;
+    if (chunk->deflate_len > 0 && ((chunk->deflate_data[0] >> 1) & 3) == 2) {
+      filtered = malloc(num_all_params * sizeof(DeflateParams));
+      if (filtered != NULL) {
+        num_candidates = 0;
+        for (i = 0; i < num_all_params; ++i) {
+          if (all_params[i].level != 0 && all_params[i].strategy != Z_FIXED) {
+            filtered[num_candidates++] = all_params[i];
+          }
+        }
+        candidates = filtered;
+      }
+    }
 
-  // We only check two combinations of encoder parameters:  level 6
-  // (the default) and level 9 (the maximum).
-  for (chunk->level = 6; chunk->level <= 9; chunk->level += 3) {
-    chunk->windowBits = -15;  // 32kb window; negative to indicate a raw stream.
-    chunk->memLevel = 8;      // the default value.
-    chunk->method = Z_DEFLATED;
-    chunk->strategy = Z_DEFAULT_STRATEGY;
-
-    if (TryReconstruction(chunk, out) == 0) {
-      free(out);
-      return 0;
+    found = SearchParams(chunk, candidates, num_candidates);
+    if (found >= 0) {
+      params = candidates[found];
+    }
+    free(filtered);
+    if (found < 0) {
+      return -1;
     }
   }
+  RememberParams(&params);
 
-  free(out);
-  return -1;
+  chunk->level = params.level;
+  chunk->method = Z_DEFLATED;
+  chunk->windowBits = params.windowBits;
+  chunk->memLevel = params.memLevel;
+  chunk->strategy = params.strategy;
+  return 0;
 }
 
+#ifdef USE_LZ4
 /*
- * Given source and target chunks, compute a bsdiff patch between them
- * by running bsdiff in a subprocess.  Return the patch data, placing
- * its length in *size.  Return NULL on failure.  We expect the bsdiff
- * program to be in the path.
+ * Return 0 if compressing the chunk's data with the given LZ4 level
+ * gives back exactly the frame we started with.  Blocks are compared
+ * as they're made so a wrong level is usually caught after the first.
  */
-unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
-  if (tgt->type == CHUNK_NORMAL) {
-    if (tgt->len <= 160) {
-      tgt->type = CHUNK_RAW;
-      *size = tgt->len;
-      return tgt->data;
+static int TryLz4Level(ImageChunk* chunk, int level, unsigned char* out) {
+  int bound = Lz4BlockBound();
+  size_t pos = 4;
+  size_t done;
+  for (done = 0; done < chunk->len; done += LZ4_LEGACY_BLOCK) {
+    int block_len = chunk->len - done < LZ4_LEGACY_BLOCK ?
+        chunk->len - done : LZ4_LEGACY_BLOCK;
+    int n = Lz4CompressBlock(chunk->data + done, block_len, out, bound, level);
+    if (n <= 0 || pos + 4 + n > chunk->deflate_len ||
+        Read4(chunk->deflate_data + pos) != n ||
+        memcmp(out, chunk->deflate_data + pos + 4, n) != 0) {
+      return -1;
     }
+    pos += 4 + n;
   }
+  return pos == chunk->deflate_len ? 0 : -1;
+}
+#endif
 
-  char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
+/*
+ * Like ReconstructDeflateChunk(), for LZ4 chunks: find the level that
+ * reproduces the frame and store it in the chunk's level field.
+ * Returns 0 on success.
+ */
+int ReconstructLz4Chunk(ImageChunk* chunk) {
+#ifdef USE_LZ4
+  if (chunk->type != CHUNK_LZ4) {
+    printf("attempt to reconstruct non-lz4 chunk\n");
+    return -1;
+  }
 
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
-  if (r != 0) {
-    printf("bsdiff() failed: %d\n", r);
-    return NULL;
+  // The lz4 tool's default, then its -9 and maximum HC levels, then
+  // the rest.  Whatever worked last time goes first.
+  static const int level_order[] = { 1, 9, 12, 3, 4, 5, 6, 7, 8, 10, 11 };
+  static int last_level = -1;
+
+  unsigned char* out = malloc(Lz4BlockBound());
+  if (out == NULL) {
+    return -1;
+  }
+  int i;
+  int level = -1;
+  if (last_level >= 0 && TryLz4Level(chunk, last_level, out) == 0) {
+    level = last_level;
+  }
+  for (i = 0; level < 0 &&
+           i < sizeof(level_order) / sizeof(level_order[0]); ++i) {
+    if (level_order[i] != last_level &&
+        TryLz4Level(chunk, level_order[i], out) == 0) {
+      level = level_order[i];
+    }
   }
+  free(out);
+  if (level < 0) {
+    return -1;
+  }
+  chunk->level = last_level = level;
+  return 0;
+#else
+  return -1;
+#endif
+}
 
-  struct stat st;
-  if (stat(ptemp, &st) != 0) {
-    printf("failed to stat patch file %s: %s\n",
-            ptemp, strerror(errno));
-    return NULL;
+typedef struct {
+  void (*fn)(void*, int);
+  void* cookie;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} ParallelWork;
+
+static void* ParallelWorkThread(void* arg) {
+  ParallelWork* work = (ParallelWork*)arg;
+  pthread_mutex_lock(&work->lock);
+  while (work->next < work->count) {
+    int i = work->next++;
+    pthread_mutex_unlock(&work->lock);
+    work->fn(work->cookie, i);
+    pthread_mutex_lock(&work->lock);
   }
+  pthread_mutex_unlock(&work->lock);
+  return NULL;
+}
 
-  unsigned char* data = malloc(st.st_size);
+/*
+ * Call fn(cookie, i) for each i in [0, count), spread over all
+ * available cores.  Items are started in increasing order of i.
+ */
+static void ParallelFor(int count, void (*fn)(void*, int), void* cookie) {
+  ParallelWork work;
+  work.fn = fn;
+  work.cookie = cookie;
+  work.count = count;
+  work.next = 0;
+  pthread_mutex_init(&work.lock, NULL);
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads > count) num_threads = count;
+  if (num_threads < 1) num_threads = 1;
+
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int started = 0;
+  while (threads != NULL && started < num_threads-1 &&
+         pthread_create(threads+started, NULL, ParallelWorkThread,
+                        &work) == 0) {
+    ++started;
+  }
+  ParallelWorkThread(&work);
+  int i;
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&work.lock);
+}
 
-  if (tgt->type == CHUNK_NORMAL && tgt->len <= st.st_size) {
-    unlink(ptemp);
+/*
+ * Return true if MakePatch() will need to run bsdiff (and so needs
+ * the source chunk's suffix array) for this target chunk.
+ */
+static int NeedsBsdiff(const ImageChunk* tgt) {
+  return !(tgt->type == CHUNK_NORMAL && tgt->len <= 160);
+}
 
+/*
+ * Given source and target chunks, compute a bsdiff patch between them.
+ * Return the patch data, placing its length in *size.  Return NULL on
+ * failure.  The source chunk's suffix array must already have been
+ * built if this is called from more than one thread at once.
+ */
+unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
+  if (!NeedsBsdiff(tgt)) {
     tgt->type = CHUNK_RAW;
     *size = tgt->len;
     return tgt->data;
   }
 
-  *size = st.st_size;
-
-  FILE* f = fopen(ptemp, "rb");
-  if (f == NULL) {
-    printf("failed to open patch %s: %s\n", ptemp, strerror(errno));
+  unsigned char* data;
+  size_t data_size;
+  int r = bsdiff_mem(src->data, src->len, &(src->I), tgt->data, tgt->len,
+                     &data, &data_size, use_zlib);
+  if (r != 0) {
+    printf("bsdiff() failed: %d\n", r);
     return NULL;
   }
-  if (fread(data, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
+
+  if (tgt->type == CHUNK_NORMAL && tgt->len <= data_size) {
+    free(data);
+
+    tgt->type = CHUNK_RAW;
+    *size = tgt->len;
+    return tgt->data;
   }
-  fclose(f);
 
-  unlink(ptemp);
+  *size = data_size;
 
   tgt->source_start = src->start;
   switch (tgt->type) {
@@ -660,6 +1111,7 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
       tgt->source_len = src->len;
       break;
     case CHUNK_DEFLATE:
+    case CHUNK_LZ4:
       tgt->source_len = src->deflate_len;
       tgt->source_uncompressed_len = src->len;
       break;
@@ -668,6 +1120,208 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+/*
+ * Record in tgt->digest the SHA-1 of what applypatch will write for
+ * the chunk, given the patch made for it.
+ */
+static void ChunkDigest(ImageChunk* tgt, const unsigned char* patch,
+                        size_t patch_size) {
+  switch (tgt->type) {
+    case CHUNK_NORMAL:
+      SHA_hash(tgt->data, tgt->len, tgt->digest);
+      break;
+    case CHUNK_DEFLATE:
+    case CHUNK_LZ4:
+      SHA_hash(tgt->deflate_data, tgt->deflate_len, tgt->digest);
+      break;
+    case CHUNK_RAW:
+      SHA_hash(patch, patch_size, tgt->digest);
+      break;
+  }
+}
+
+// States of a source chunk's suffix array.
+#define SA_NONE      0
+#define SA_BUILDING  1
+#define SA_READY     2
+
+// The chunk patches still to be made: tgt_chunks[i] is patched
+// against srcs[i].
+typedef struct {
+  ImageChunk* tgt_chunks;
+  ImageChunk** srcs;
+  int* order;                 // grouped by source, biggest targets first
+  unsigned char** patch_data;
+  size_t* patch_size;
+
+  ImageChunk** unique_srcs;   // sources that need a suffix array
+  int* src_index;             // per target: entry in unique_srcs, or -1
+  int* src_users;             // per unique source: targets still to do
+  int* src_state;             // per unique source: SA_*
+
+  size_t budget;              // bytes the running jobs may use
+  size_t in_use;
+  int running;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} PatchJobs;
+
+static size_t SuffixArrayBytes(const ImageChunk* src) {
+  // See build_suffix_array() in bsdiff.c.
+  return (src->len < INT32_MAX ? 4 : 16) * (src->len + 1);
+}
+
+// What bsdiff_mem() allocates besides the suffix array: the diff and
+// extra blocks, and (at most about as much again) the patch.
+static size_t PatchBytes(const ImageChunk* tgt) {
+  return NeedsBsdiff(tgt) ? 3 * (tgt->len + 1) : 0;
+}
+
+static void MakePatchJob(void* cookie, int n) {
+  PatchJobs* jobs = (PatchJobs*)cookie;
+  int i = jobs->order[n];
+  ImageChunk* tgt = jobs->tgt_chunks + i;
+  int s = jobs->src_index[i];
+  ImageChunk* src = s >= 0 ? jobs->unique_srcs[s] : NULL;
+  size_t need = PatchBytes(tgt);
+
+  // Wait until there's room for this job (and the source's suffix
+  // array, if nobody has built it yet).  A job always starts when
+  // nothing else is running, however big it is.
+  pthread_mutex_lock(&jobs->lock);
+  for (;;) {
+    size_t sa = (src && jobs->src_state[s] == SA_NONE) ?
+        SuffixArrayBytes(src) : 0;
+    if (jobs->running == 0 || jobs->in_use + need + sa <= jobs->budget) {
+      break;
+    }
+    pthread_cond_wait(&jobs->cond, &jobs->lock);
+  }
+  ++jobs->running;
+  jobs->in_use += need;
+  if (src && jobs->src_state[s] == SA_NONE) {
+    jobs->src_state[s] = SA_BUILDING;
+    jobs->in_use += SuffixArrayBytes(src);
+    pthread_mutex_unlock(&jobs->lock);
+    src->I = load_suffix_array(src->data, src->len, sa_cache_dir);
+    pthread_mutex_lock(&jobs->lock);
+    jobs->src_state[s] = SA_READY;
+    pthread_cond_broadcast(&jobs->cond);
+  }
+  while (src && jobs->src_state[s] != SA_READY) {
+    pthread_cond_wait(&jobs->cond, &jobs->lock);
+  }
+  pthread_mutex_unlock(&jobs->lock);
+
+  jobs->patch_data[i] = MakePatch(jobs->srcs[i], tgt, jobs->patch_size+i);
+  if (jobs->patch_data[i] != NULL) {
+    ChunkDigest(tgt, jobs->patch_data[i], jobs->patch_size[i]);
+    // The expanded target of a deflate chunk isn't needed any more.
+    if (tgt->type == CHUNK_DEFLATE || tgt->type == CHUNK_LZ4) {
+      free(tgt->data);
+      tgt->data = NULL;
+    }
+  }
+
+  // Drop the source's suffix array (and expanded data) after its
+  // last target.
+  pthread_mutex_lock(&jobs->lock);
+  jobs->in_use -= need;
+  --jobs->running;
+  if (src && --jobs->src_users[s] == 0) {
+    free_suffix_array(src->I);
+    src->I = NULL;
+    jobs->in_use -= SuffixArrayBytes(src);
+    if (src->type == CHUNK_DEFLATE || src->type == CHUNK_LZ4) {
+      free(src->data);
+      src->data = NULL;
+    }
+  }
+  pthread_cond_broadcast(&jobs->cond);
+  pthread_mutex_unlock(&jobs->lock);
+}
+
+static PatchJobs* sort_jobs;
+static int by_source_then_bigger_target(const void* a, const void* b) {
+  int ia = *(const int*)a;
+  int ib = *(const int*)b;
+  int sa = sort_jobs->src_index[ia];
+  int sb = sort_jobs->src_index[ib];
+  if (sa != sb) {
+    // Targets that don't need bsdiff go last.
+    if (sa < 0 || sb < 0) return sa < 0 ? 1 : -1;
+    size_t la = sort_jobs->unique_srcs[sa]->len;
+    size_t lb = sort_jobs->unique_srcs[sb]->len;
+    if (la != lb) return la > lb ? -1 : 1;
+    return sa - sb;
+  }
+  size_t la = sort_jobs->tgt_chunks[ia].len;
+  size_t lb = sort_jobs->tgt_chunks[ib].len;
+  if (la != lb) return la > lb ? -1 : 1;
+  return ia - ib;
+}
+
+/*
+ * Make the patch for each target chunk, using as many cores as are
+ * available, and fill in each target's digest.  Targets are taken
+ * source by source, biggest first; each source's suffix array is
+ * built (once, even when several targets share a source) by the first
+ * job that needs it and freed after the last, along with the expanded
+ * data of deflate chunks once nothing needs it.  Jobs wait while
+ * starting them would take the memory they're using past half of the
+ * machine's RAM, so that big images are diffed a few chunks at a time
+ * rather than all at once.
+ */
+void MakePatches(ImageChunk* tgt_chunks, ImageChunk** srcs, int num_chunks,
+                 unsigned char** patch_data, size_t* patch_size) {
+  PatchJobs jobs;
+  int i, j, num_unique = 0;
+
+  memset(&jobs, 0, sizeof(jobs));
+  jobs.tgt_chunks = tgt_chunks;
+  jobs.srcs = srcs;
+  jobs.patch_data = patch_data;
+  jobs.patch_size = patch_size;
+  jobs.order = malloc(num_chunks * sizeof(int));
+  jobs.unique_srcs = malloc(num_chunks * sizeof(ImageChunk*));
+  jobs.src_index = malloc(num_chunks * sizeof(int));
+  jobs.src_users = calloc(num_chunks, sizeof(int));
+  jobs.src_state = calloc(num_chunks, sizeof(int));
+
+  for (i = 0; i < num_chunks; ++i) {
+    jobs.order[i] = i;
+    jobs.src_index[i] = -1;
+    if (!NeedsBsdiff(tgt_chunks+i)) continue;
+    for (j = 0; j < num_unique && jobs.unique_srcs[j] != srcs[i]; ++j);
+    if (j == num_unique) {
+      jobs.unique_srcs[num_unique] = srcs[i];
+      jobs.src_state[num_unique] = srcs[i]->I != NULL ? SA_READY : SA_NONE;
+      ++num_unique;
+    }
+    jobs.src_index[i] = j;
+    ++jobs.src_users[j];
+  }
+
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  jobs.budget = (pages > 0 && page_size > 0) ?
+      (size_t)pages * page_size / 2 : (size_t)-1;
+  pthread_mutex_init(&jobs.lock, NULL);
+  pthread_cond_init(&jobs.cond, NULL);
+
+  sort_jobs = &jobs;
+  qsort(jobs.order, num_chunks, sizeof(int), by_source_then_bigger_target);
+  ParallelFor(num_chunks, MakePatchJob, &jobs);
+
+  pthread_mutex_destroy(&jobs.lock);
+  pthread_cond_destroy(&jobs.cond);
+  free(jobs.order);
+  free(jobs.unique_srcs);
+  free(jobs.src_index);
+  free(jobs.src_users);
+  free(jobs.src_state);
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -676,7 +1330,7 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
  * treating the ones that aren't as normal chunks).
  */
 void ChangeDeflateChunkToNormal(ImageChunk* ch) {
-  if (ch->type != CHUNK_DEFLATE) return;
+  if (ch->type != CHUNK_DEFLATE && ch->type != CHUNK_LZ4) return;
   ch->type = CHUNK_NORMAL;
   free(ch->data);
   ch->data = ch->deflate_data;
@@ -695,6 +1349,7 @@ int AreChunksEqual(ImageChunk* a, ImageChunk* b) {
             return a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
 
         case CHUNK_DEFLATE:
+        case CHUNK_LZ4:
             return a->deflate_len == b->deflate_len &&
                 memcmp(a->deflate_data, b->deflate_data, a->deflate_len) == 0;
 
@@ -788,6 +1443,29 @@ int main(int argc, char** argv) {
     ++argv;
   }
 
+  if (argc >= 2 && strcmp(argv[1], "-Z") == 0) {
+    use_zlib = 1;
+    --argc;
+    ++argv;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "-l") == 0) {
+#ifdef USE_LZ4
+    use_lz4 = 1;
+    --argc;
+    ++argv;
+#else
+    printf("imgdiff was built without LZ4 support\n");
+    return 1;
+#endif
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "-c") == 0) {
+    sa_cache_dir = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
+
   size_t bonus_size = 0;
   unsigned char* bonus_data = NULL;
   if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
@@ -815,7 +1493,8 @@ int main(int argc, char** argv) {
 
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
+    printf("usage: %s [-z] [-Z] [-l] [-c <cache-dir>] [-b <bonus-file>] "
+           "<src-img> <tgt-img> <patch-file>\n",
             argv[0]);
     return 2;
   }
@@ -916,6 +1595,17 @@ int main(int argc, char** argv) {
           ChangeDeflateChunkToNormal(src);
         }
       }
+    } else if (tgt_chunks[i].type == CHUNK_LZ4) {
+      // Same again for LZ4 frames (which only come from images).
+      if (ReconstructLz4Chunk(tgt_chunks+i) < 0) {
+        printf("failed to reconstruct target lz4 chunk %d; "
+               "treating as normal\n", i);
+        ChangeDeflateChunkToNormal(tgt_chunks+i);
+        ChangeDeflateChunkToNormal(src_chunks+i);
+      } else if (AreChunksEqual(tgt_chunks+i, src_chunks+i)) {
+        ChangeDeflateChunkToNormal(tgt_chunks+i);
+        ChangeDeflateChunkToNormal(src_chunks+i);
+      }
     }
   }
 
@@ -946,15 +1636,16 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  ImageChunk** patch_src = malloc(num_tgt_chunks * sizeof(ImageChunk*));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,7 +1655,16 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      patch_src[i] = src_chunks+i;
+    }
+  }
+
+  MakePatches(tgt_chunks, patch_src, num_tgt_chunks, patch_data, patch_size);
+
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL) {
+      printf("failed to make patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
@@ -984,6 +1684,9 @@ int main(int argc, char** argv) {
       case CHUNK_DEFLATE:
         total_header_size += 8*5 + 4*5;
         break;
+      case CHUNK_LZ4:
+        total_header_size += 8*5 + 4;
+        break;
       case CHUNK_RAW:
         total_header_size += 4 + patch_size[i];
         break;
@@ -1028,6 +1731,19 @@ int main(int argc, char** argv) {
         offset += patch_size[i];
         break;
 
+      case CHUNK_LZ4:
+        printf("chunk %3d: lz4      (%10d, %10d)  %10d  level %d\n", i,
+               tgt_chunks[i].start, tgt_chunks[i].deflate_len, patch_size[i],
+               tgt_chunks[i].level);
+        Write8(tgt_chunks[i].source_start, f);
+        Write8(tgt_chunks[i].source_len, f);
+        Write8(offset, f);
+        Write8(tgt_chunks[i].source_uncompressed_len, f);
+        Write8(tgt_chunks[i].len, f);
+        Write4(tgt_chunks[i].level, f);
+        offset += patch_size[i];
+        break;
+
       case CHUNK_RAW:
         printf("chunk %3d: raw      (%10d, %10d)\n", i,
                tgt_chunks[i].start, tgt_chunks[i].len);
@@ -1045,6 +1761,13 @@ int main(int argc, char** argv) {
     }
   }
 
+  // And the digest of what each chunk produces.
+
+  fwrite(IMGDIFF_DIGEST_MAGIC, 1, 8, f);
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    fwrite(tgt_chunks[i].digest, 1, SHA_DIGEST_SIZE, f);
+  }
+
   fclose(f);
 
   return 0;
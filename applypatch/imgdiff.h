@@ -19,6 +19,11 @@
 #define CHUNK_GZIP     1   // version 1 only
 #define CHUNK_DEFLATE  2   // version 2 only
 #define CHUNK_RAW      3   // version 2 only
+#define CHUNK_LZ4      4   // version 2 only; see lz4chunk.h
+
+// Marks the optional table of per-chunk target SHA-1s at the end of
+// an IMGDIFF2 patch; see imgdiff.c.
+#define IMGDIFF_DIGEST_MAGIC "IMGDSHA1"
 
 // The gzip header size is actually variable, but we currently don't
 // support gzipped data with any of the optional fields, so for now it
@@ -18,8 +18,10 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -27,26 +29,332 @@
 #include "mincrypt/sha.h"
 #include "applypatch.h"
 #include "imgdiff.h"
+#include "lz4chunk.h"
 #include "utils.h"
 
+// One chunk of an IMGDIFF2 patch.  Deflate and LZ4 chunks are the
+// expensive ones (expand + bspatch + recompress) and are independent
+// of each other, so they may be produced ahead of time on worker threads;
+// their compressed output waits in 'output' until the chunks before
+// them have been written.
+typedef struct {
+    int type;
+    int index;                  // position of the chunk in the patch
+    const char* header;         // type-specific header record
+    ssize_t data_pos;           // CHUNK_RAW only: offset of the data
+    const uint8_t* digest;      // SHA-1 of the chunk's output, if known
+
+    int state;                  // CHUNK_DEFLATE and CHUNK_LZ4: JOB_*
+    unsigned char* output;
+    ssize_t output_size;
+} PatchChunk;
+
+#define JOB_PENDING  0
+#define JOB_RUNNING  1
+#define JOB_DONE     2
+#define JOB_FAILED   3
+
+typedef struct {
+    const unsigned char* old_data;
+    ssize_t old_size;
+    const Value* patch;
+    const Value* bonus_data;
+
+    PatchChunk** jobs;          // the compressed chunks, in patch order
+    int num_jobs;
+    int next_job;               // first job nobody has claimed yet
+    int committed_jobs;         // jobs already written to the sink
+    int max_ahead;              // limit on claimed-but-unwritten jobs
+    int abort;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ImagePatchState;
+
 /*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
+ * Reconstruct the target data for one CHUNK_DEFLATE chunk: inflate
+ * the source, apply the bsdiff patch in memory, and deflate the
+ * result into chunk->output with the parameters recorded in the
+ * chunk header.  Returns 0 on success.
  */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
-                    const Value* bonus_data) {
+static int PatchDeflateChunk(const ImagePatchState* st, PatchChunk* chunk) {
+    const char* deflate_header = chunk->header;
+    size_t src_start = Read8(deflate_header);
+    size_t src_len = Read8(deflate_header+8);
+    size_t patch_offset = Read8(deflate_header+16);
+    size_t expanded_len = Read8(deflate_header+24);
+    int level = Read4(deflate_header+40);
+    int method = Read4(deflate_header+44);
+    int windowBits = Read4(deflate_header+48);
+    int memLevel = Read4(deflate_header+52);
+    int strategy = Read4(deflate_header+56);
+
+    if (src_start > (size_t)st->old_size ||
+        src_len > (size_t)st->old_size - src_start) {
+        printf("chunk %d source data out of range\n", chunk->index);
+        return -1;
+    }
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if
+    // the patch was constructed with bonus data.  The
+    // deflation will come up 'bonus_size' bytes short; these
+    // must be appended from the bonus_data value.
+    size_t bonus_size = (chunk->index == 1 && st->bonus_data != NULL) ?
+        st->bonus_data->size : 0;
+
+    unsigned char* expanded_source = malloc(expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = src_len;
+    strm.next_in = (unsigned char*)(st->old_data + src_start);
+    strm.avail_out = expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != bonus_size) {
+        printf("source inflation short by %d bytes\n", strm.avail_out-bonus_size);
+        free(expanded_source);
+        return -1;
+    }
+
+    if (bonus_size) {
+        memcpy(expanded_source + (expanded_len - bonus_size),
+               st->bonus_data->data, bonus_size);
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    ret = ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                              st->patch, patch_offset,
+                              &uncompressed_target_data,
+                              &uncompressed_target_size);
+    free(expanded_source);
+    if (ret != 0) {
+        return -1;
+    }
+
+    // Now compress the target data into a buffer big enough to hold
+    // all of it, so it can be written out whenever its turn comes.
+    // (deflate's output doesn't depend on how the output space is
+    // handed to it, so this matches the streaming result exactly.)
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
+    if (ret != Z_OK) {
+        printf("failed to init target deflation: %d\n", ret);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    uLong bound = deflateBound(&strm, uncompressed_target_size);
+    chunk->output = malloc(bound);
+    if (chunk->output == NULL) {
+        printf("failed to allocate %lu bytes for chunk %d output\n",
+               bound, chunk->index);
+        deflateEnd(&strm);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    strm.avail_out = bound;
+    strm.next_out = chunk->output;
+    ret = deflate(&strm, Z_FINISH);
+    chunk->output_size = bound - strm.avail_out;
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
+
+    if (ret != Z_STREAM_END) {
+        printf("target deflation of chunk %d returned %d\n",
+               chunk->index, ret);
+        free(chunk->output);
+        chunk->output = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The same for one CHUNK_LZ4 chunk: expand the source frame, apply
+ * the bsdiff patch and recompress the result into a new frame at the
+ * level recorded in the chunk header.  Returns 0 on success.
+ */
+static int PatchLz4Chunk(const ImagePatchState* st, PatchChunk* chunk) {
+#ifdef USE_LZ4
+    const char* lz4_header = chunk->header;
+    size_t src_start = Read8(lz4_header);
+    size_t src_len = Read8(lz4_header+8);
+    size_t patch_offset = Read8(lz4_header+16);
+    size_t expanded_len = Read8(lz4_header+24);
+    int level = Read4(lz4_header+40);
+
+    if (src_start > (size_t)st->old_size ||
+        src_len > (size_t)st->old_size - src_start) {
+        printf("chunk %d source data out of range\n", chunk->index);
+        return -1;
+    }
+
+    size_t bonus_size = (chunk->index == 1 && st->bonus_data != NULL) ?
+        st->bonus_data->size : 0;
+
+    unsigned char* expanded_source;
+    size_t expanded_size;
+    if (Lz4LegacyDecompress(st->old_data + src_start, src_len,
+                            &expanded_source, &expanded_size) != src_len) {
+        printf("failed to expand chunk %d source\n", chunk->index);
+        free(expanded_source);
+        return -1;
+    }
+    if (expanded_size + bonus_size != expanded_len) {
+        printf("chunk %d source expanded to %d bytes; expected %d\n",
+               chunk->index, expanded_size, expanded_len - bonus_size);
+        free(expanded_source);
+        return -1;
+    }
+    if (bonus_size) {
+        unsigned char* grown = realloc(expanded_source, expanded_len);
+        if (grown == NULL) {
+            printf("failed to allocate %d bytes for expanded_source\n",
+                   expanded_len);
+            free(expanded_source);
+            return -1;
+        }
+        expanded_source = grown;
+        memcpy(expanded_source + expanded_size, st->bonus_data->data,
+               bonus_size);
+    }
+
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    int ret = ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                                  st->patch, patch_offset,
+                                  &uncompressed_target_data,
+                                  &uncompressed_target_size);
+    free(expanded_source);
+    if (ret != 0) {
+        return -1;
+    }
+
+    size_t output_size;
+    ret = Lz4LegacyCompress(uncompressed_target_data, uncompressed_target_size,
+                            level, &chunk->output, &output_size);
+    free(uncompressed_target_data);
+    if (ret != 0) {
+        printf("target compression of chunk %d failed\n", chunk->index);
+        return -1;
+    }
+    chunk->output_size = output_size;
+    return 0;
+#else
+    printf("chunk %d is LZ4, but this applypatch was built without "
+           "LZ4 support\n", chunk->index);
+    return -1;
+#endif
+}
+
+static int PatchCompressedChunk(const ImagePatchState* st, PatchChunk* chunk) {
+    if (chunk->type == CHUNK_LZ4) {
+        return PatchLz4Chunk(st, chunk);
+    }
+    return PatchDeflateChunk(st, chunk);
+}
+
+// Run the given (already claimed) job and publish its result.  Called
+// with st->lock held; drops it while working.
+static void RunDeflateJob(ImagePatchState* st, PatchChunk* chunk) {
+    chunk->state = JOB_RUNNING;
+    pthread_mutex_unlock(&st->lock);
+    int ok = PatchCompressedChunk(st, chunk) == 0;
+    pthread_mutex_lock(&st->lock);
+    chunk->state = ok ? JOB_DONE : JOB_FAILED;
+    pthread_cond_broadcast(&st->cond);
+}
+
+static void* DeflateWorker(void* cookie) {
+    ImagePatchState* st = (ImagePatchState*)cookie;
+
+    pthread_mutex_lock(&st->lock);
+    while (!st->abort && st->next_job < st->num_jobs) {
+        // Don't run too far ahead of the writer; finished chunks hold
+        // their whole compressed output in memory.
+        if (st->next_job >= st->committed_jobs + st->max_ahead) {
+            pthread_cond_wait(&st->cond, &st->lock);
+            continue;
+        }
+        RunDeflateJob(st, st->jobs[st->next_job++]);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+// Wait for the given job to finish (running it on this thread if no
+// worker has picked it up yet).  Returns 0 if its output is ready.
+static int FinishDeflateJob(ImagePatchState* st, int job) {
+    PatchChunk* chunk = st->jobs[job];
+
+    pthread_mutex_lock(&st->lock);
+    // Jobs are claimed in order, and every earlier job has already
+    // been written, so either this is the next one to claim or
+    // somebody already has it.
+    if (st->next_job == job) {
+        ++st->next_job;
+        RunDeflateJob(st, chunk);
+    }
+    while (chunk->state != JOB_DONE && chunk->state != JOB_FAILED) {
+        pthread_cond_wait(&st->cond, &st->lock);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return chunk->state == JOB_DONE ? 0 : -1;
+}
+
+/*
+ * Parse the chunk table of an IMGDIFF2 patch into a malloc'd array
+ * of num_chunks entries (with 'type', 'index', 'header' and, for raw
+ * chunks, 'data_pos' filled in).  Returns the number of chunks, or -1
+ * if the patch is malformed.
+ */
+static int ReadChunkTable(const Value* patch, PatchChunk** chunks_out) {
     ssize_t pos = 12;
     char* header = patch->data;
+    *chunks_out = NULL;
     if (patch->size < 12) {
         printf("patch too short to contain header\n");
         return -1;
     }
 
-    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
+    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW and
+    // CHUNK_LZ4.
     // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
     // CHUNK_GZIP.)
     if (memcmp(header, "IMGDIFF2", 8) != 0) {
@@ -55,178 +363,311 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
     }
 
     int num_chunks = Read4(header+8);
+    if (num_chunks < 0 || num_chunks > (patch->size - 12) / 4) {
+        printf("corrupt patch file header (chunk count)\n");
+        return -1;
+    }
+
+    PatchChunk* chunks = calloc(num_chunks > 0 ? num_chunks : 1,
+                                sizeof(PatchChunk));
+    if (chunks == NULL) {
+        printf("failed to allocate chunk table for %d chunks\n", num_chunks);
+        return -1;
+    }
 
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        PatchChunk* chunk = chunks + i;
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        chunk->type = Read4(patch->data + pos);
+        chunk->index = i;
         pos += 4;
+        chunk->header = patch->data + pos;
 
-        if (type == CHUNK_NORMAL) {
-            char* normal_header = patch->data + pos;
+        if (chunk->type == CHUNK_NORMAL) {
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
-
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
-            char* raw_header = patch->data + pos;
+        } else if (chunk->type == CHUNK_RAW) {
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            ssize_t data_len = Read4(raw_header);
+            ssize_t data_len = Read4(chunk->header);
 
-            if (pos + data_len > patch->size) {
+            if (data_len < 0 || pos + data_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
-            }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
+            chunk->data_pos = pos;
             pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+        } else if (chunk->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
-            char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
-
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            // Note: expanded_len will include the bonus data size if
-            // the patch was constructed with bonus data.  The
-            // deflation will come up 'bonus_size' bytes short; these
-            // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
+        } else if (chunk->type == CHUNK_LZ4) {
+            // lz4 chunks have an additional 44 bytes in their chunk header.
+            pos += 44;
+            if (pos > patch->size) {
+                printf("failed to read chunk %d lz4 header data\n", i);
+                goto fail;
             }
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, chunk->type);
+            goto fail;
+        }
+    }
+
+    // Newer patches end with the SHA-1 of each chunk's output.
+    ssize_t table = patch->size - 8 - (ssize_t)num_chunks * SHA_DIGEST_SIZE;
+    if (table >= pos &&
+        memcmp(patch->data + table, IMGDIFF_DIGEST_MAGIC, 8) == 0) {
+        for (i = 0; i < num_chunks; ++i) {
+            chunks[i].digest = (const uint8_t*)patch->data + table + 8 +
+                i * SHA_DIGEST_SIZE;
+        }
+    }
+
+    *chunks_out = chunks;
+    return num_chunks;
+
+  fail:
+    free(chunks);
+    return -1;
+}
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
+/*
+ * List the ranges of the source that an IMGDIFF2 patch reads (the
+ * src_start and src_len of each normal, deflate and LZ4 chunk) without
+ * applying it, so that a caller can avoid loading the rest.  Returns
+ * the number of ranges, in a malloc'd *ranges, or -1 if 'patch' isn't
+ * a well-formed IMGDIFF2 patch.
+ */
+int ImagePatchSourceRanges(const Value* patch, SourceRange** ranges) {
+    *ranges = NULL;
+    if (patch->size < 8 || memcmp(patch->data, "IMGDIFF2", 8) != 0) {
+        return -1;
+    }
+
+    PatchChunk* chunks;
+    int num_chunks = ReadChunkTable(patch, &chunks);
+    if (num_chunks < 0) {
+        return -1;
+    }
+
+    *ranges = malloc((num_chunks > 0 ? num_chunks : 1) * sizeof(SourceRange));
+    if (*ranges == NULL) {
+        free(chunks);
+        return -1;
+    }
+    int count = 0;
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        if (chunks[i].type == CHUNK_NORMAL || chunks[i].type == CHUNK_DEFLATE ||
+            chunks[i].type == CHUNK_LZ4) {
+            (*ranges)[count].start = Read8(chunks[i].header);
+            (*ranges)[count].len = Read8(chunks[i].header+8);
+            ++count;
+        }
+    }
+    free(chunks);
+    return count;
+}
+
+// Passes a normal chunk's output on to the real sink, hashing it on
+// the way so it can be checked against the chunk's digest.  Only used
+// for chunks that have one.
+typedef struct {
+    SinkFn sink;
+    void* token;
+    SHA_CTX sha;
+} ChunkSinkInfo;
+
+static ssize_t ChunkSink(unsigned char* data, ssize_t len, void* token) {
+    ChunkSinkInfo* csi = (ChunkSinkInfo*)token;
+    SHA_update(&csi->sha, data, len);
+    return csi->sink(data, len, csi->token);
+}
+
+// Returns 0 if 'chunk' has no digest or (data, len) matches it.
+static int CheckChunk(const PatchChunk* chunk,
+                      const unsigned char* data, ssize_t len) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (chunk->digest == NULL) return 0;
+    SHA_hash(data, len, digest);
+    return memcmp(digest, chunk->digest, SHA_DIGEST_SIZE) == 0 ? 0 : -1;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    const Value* bonus_data) {
+    int result = -1;
+    int num_workers = 0;
+    pthread_t* workers = NULL;
+
+    PatchChunk* chunks;
+    int num_chunks = ReadChunkTable(patch, &chunks);
+    if (num_chunks < 0) {
+        return -1;
+    }
+
+    ImagePatchState st;
+    memset(&st, 0, sizeof(st));
+    st.old_data = old_data;
+    st.old_size = old_size;
+    st.patch = patch;
+    st.bonus_data = bonus_data;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+
+    // Queue up the deflate and LZ4 chunks, so that they can be worked
+    // on before we get to them.
+    st.jobs = malloc((num_chunks > 0 ? num_chunks : 1) * sizeof(PatchChunk*));
+    if (st.jobs == NULL) {
+        printf("failed to allocate job table for %d chunks\n", num_chunks);
+        goto done;
+    }
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        if (chunks[i].type == CHUNK_DEFLATE || chunks[i].type == CHUNK_LZ4) {
+            chunks[i].state = JOB_PENDING;
+            st.jobs[st.num_jobs++] = chunks + i;
+        }
+    }
+
+    // Rebuild compressed chunks on the other cores while this thread
+    // writes the output in order.
+    if (st.num_jobs > 1) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cpus > 1 ? cpus - 1 : 0;
+        if (num_workers > st.num_jobs - 1) {
+            num_workers = st.num_jobs - 1;
+        }
+    }
+    st.max_ahead = 2 * (num_workers + 1);
+    if (num_workers > 0) {
+        workers = malloc(num_workers * sizeof(pthread_t));
+        if (workers == NULL) {
+            num_workers = 0;
+        }
+    }
+    for (i = 0; i < num_workers; ++i) {
+        if (pthread_create(&workers[i], NULL, DeflateWorker, &st) != 0) {
+            num_workers = i;
+            break;
+        }
+    }
+
+    int job = 0;
+    for (i = 0; i < num_chunks; ++i) {
+        PatchChunk* chunk = chunks + i;
+
+        if (chunk->type == CHUNK_NORMAL) {
+            size_t src_start = Read8(chunk->header);
+            size_t src_len = Read8(chunk->header+8);
+            size_t patch_offset = Read8(chunk->header+16);
+
+            if (src_start > (size_t)old_size ||
+                src_len > (size_t)old_size - src_start) {
+                printf("chunk %d source data out of range\n", i);
+                goto done;
             }
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
+            // Normal chunks stream straight to the sink (they can be
+            // as big as the whole image), hashed on the way if there
+            // is a digest to check them against.
+            ChunkSinkInfo csi;
+            csi.sink = sink;
+            csi.token = token;
+            SHA_init(&csi.sha);
+            if (ApplyBSDiffPatch(old_data + src_start, src_len,
+                                 patch, patch_offset,
+                                 chunk->digest != NULL ? ChunkSink : sink,
+                                 chunk->digest != NULL ? (void*)&csi : token,
+                                 ctx) != 0) {
+                printf("failed to patch chunk %d\n", i);
+                goto done;
             }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %d bytes\n", strm.avail_out-bonus_size);
-                return -1;
+            if (chunk->digest != NULL &&
+                memcmp(SHA_final(&csi.sha), chunk->digest,
+                       SHA_DIGEST_SIZE) != 0) {
+                printf("chunk %d output doesn't match its digest\n", i);
+                goto done;
             }
-            inflateEnd(&strm);
+        } else if (chunk->type == CHUNK_RAW) {
+            ssize_t data_len = Read4(chunk->header);
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
+            if (CheckChunk(chunk, (unsigned char*)patch->data + chunk->data_pos,
+                           data_len) != 0) {
+                printf("chunk %d raw data doesn't match its digest\n", i);
+                goto done;
             }
-
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
+            if (ctx) SHA_update(ctx, patch->data + chunk->data_pos, data_len);
+            if (sink((unsigned char*)patch->data + chunk->data_pos,
+                     data_len, token) != data_len) {
+                printf("failed to write chunk %d raw data\n", i);
+                goto done;
             }
-
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+        } else {
+            if (FinishDeflateJob(&st, job) != 0) {
+                goto done;
+            }
+            if (CheckChunk(chunk, chunk->output, chunk->output_size) != 0) {
+                printf("chunk %d output doesn't match its digest\n", i);
+                goto done;
             }
+            ssize_t have = chunk->output_size;
+            if (sink(chunk->output, have, token) != have) {
+                printf("failed to write %ld compressed bytes to output\n",
+                       (long)have);
+                goto done;
+            }
+            if (ctx) SHA_update(ctx, chunk->output, have);
+            free(chunk->output);
+            chunk->output = NULL;
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+            pthread_mutex_lock(&st.lock);
+            st.committed_jobs = ++job;
+            pthread_cond_broadcast(&st.cond);
+            pthread_mutex_unlock(&st.lock);
         }
     }
+    result = 0;
 
-    return 0;
+  done:
+    pthread_mutex_lock(&st.lock);
+    st.abort = 1;
+    pthread_cond_broadcast(&st.cond);
+    pthread_mutex_unlock(&st.lock);
+    for (i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    for (i = 0; i < num_chunks; ++i) {
+        free(chunks[i].output);
+    }
+    free(chunks);
+    free(st.jobs);
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+    return result;
 }
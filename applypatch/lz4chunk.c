@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef USE_LZ4
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+#include "lz4hc.h"
+#include "lz4chunk.h"
+#include "utils.h"
+
+ssize_t Lz4LegacyDecompress(const unsigned char* data, size_t len,
+                            unsigned char** out, size_t* out_len) {
+  *out = NULL;
+  *out_len = 0;
+  if (len < 4 || (unsigned int)Read4(data) != LZ4_LEGACY_MAGIC) {
+    return -1;
+  }
+
+  // There is no end marker: the frame ends after a block that expands
+  // to less than a full block, or where the next thing can't be a
+  // block (another frame, or whatever follows the data).
+  size_t pos = 4;
+  int bound = Lz4BlockBound();
+  while (pos + 4 <= len) {
+    unsigned int block_len = Read4(data + pos);
+    if (block_len == LZ4_LEGACY_MAGIC || block_len == 0 ||
+        block_len > (unsigned int)bound || block_len > len - pos - 4) {
+      break;
+    }
+    unsigned char* grown = realloc(*out, *out_len + LZ4_LEGACY_BLOCK);
+    if (grown == NULL) {
+      break;
+    }
+    *out = grown;
+    int n = LZ4_decompress_safe((const char*)data + pos + 4,
+                                (char*)*out + *out_len,
+                                block_len, LZ4_LEGACY_BLOCK);
+    if (n < 0) {
+      break;
+    }
+    *out_len += n;
+    pos += 4 + block_len;
+    if (n < LZ4_LEGACY_BLOCK) {
+      break;
+    }
+  }
+
+  if (pos == 4) {
+    free(*out);
+    *out = NULL;
+    return -1;
+  }
+  return pos;
+}
+
+int Lz4CompressBlock(const unsigned char* data, int len,
+                     unsigned char* out, int out_size, int level) {
+  if (level < 3) {
+    return LZ4_compress_default((const char*)data, (char*)out, len, out_size);
+  }
+  return LZ4_compress_HC((const char*)data, (char*)out, len, out_size, level);
+}
+
+int Lz4BlockBound() {
+  return LZ4_compressBound(LZ4_LEGACY_BLOCK);
+}
+
+static void Put4(unsigned int value, unsigned char* p) {
+  p[0] = value & 0xff;
+  p[1] = (value >> 8) & 0xff;
+  p[2] = (value >> 16) & 0xff;
+  p[3] = (value >> 24) & 0xff;
+}
+
+int Lz4LegacyCompress(const unsigned char* data, size_t len, int level,
+                      unsigned char** out, size_t* out_len) {
+  size_t blocks = (len + LZ4_LEGACY_BLOCK - 1) / LZ4_LEGACY_BLOCK;
+  int bound = Lz4BlockBound();
+  *out = malloc(4 + blocks * (4 + (size_t)bound));
+  if (*out == NULL) {
+    return -1;
+  }
+
+  Put4(LZ4_LEGACY_MAGIC, *out);
+  size_t pos = 4;
+  size_t done;
+  for (done = 0; done < len; done += LZ4_LEGACY_BLOCK) {
+    int block_len = len - done < LZ4_LEGACY_BLOCK ? len - done : LZ4_LEGACY_BLOCK;
+    int n = Lz4CompressBlock(data + done, block_len, *out + pos + 4, bound, level);
+    if (n <= 0) {
+      free(*out);
+      *out = NULL;
+      return -1;
+    }
+    Put4(n, *out + pos);
+    pos += 4 + n;
+  }
+  *out_len = pos;
+  return 0;
+}
+
+#endif  // USE_LZ4
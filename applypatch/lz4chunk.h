@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUILD_TOOLS_APPLYPATCH_LZ4CHUNK_H
+#define _BUILD_TOOLS_APPLYPATCH_LZ4CHUNK_H
+
+#include <sys/types.h>
+
+// LZ4 "legacy" frames, as written by "lz4 -l" (which is what the
+// kernel build uses for LZ4-compressed kernels and ramdisks): a magic
+// number, then a series of blocks, each a 4-byte little-endian
+// compressed length followed by up to LZ4_LEGACY_BLOCK bytes of data
+// compressed independently.  Every block but the last expands to
+// exactly LZ4_LEGACY_BLOCK bytes.
+//
+// Only available when built with USE_LZ4.
+
+#define LZ4_LEGACY_MAGIC  0x184c2102
+#define LZ4_LEGACY_BLOCK  (8 << 20)
+
+// Expand the legacy frame that starts at 'data' (and ends somewhere
+// within 'len' bytes) into a malloc'd buffer.  Returns the length of
+// the frame, or -1 if 'data' doesn't start with one.
+ssize_t Lz4LegacyDecompress(const unsigned char* data, size_t len,
+                            unsigned char** out, size_t* out_len);
+
+// Compress one block the way "lz4 -l -<level>" does: levels below 3
+// use the fast compressor, the rest LZ4 HC.  Returns the compressed
+// size, or 0 on failure.
+int Lz4CompressBlock(const unsigned char* data, int len,
+                     unsigned char* out, int out_size, int level);
+
+// The worst-case compressed size of one block.
+int Lz4BlockBound();
+
+// Compress 'data' into a legacy frame in a malloc'd buffer.  Returns
+// 0 on success.
+int Lz4LegacyCompress(const unsigned char* data, size_t len, int level,
+                      unsigned char** out, size_t* out_len);
+
+#endif  // _BUILD_TOOLS_APPLYPATCH_LZ4CHUNK_H
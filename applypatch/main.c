@@ -30,17 +30,70 @@ int CheckMode(int argc, char** argv) {
     return applypatch_check(argv[2], argc-3, argv+3);
 }
 
+// argv[2:] are pairs of "<file> <sha1>[:<sha1>...]"; the sha1 list
+// may be empty.
+int BatchCheckMode(int argc, char** argv) {
+    if (argc < 4 || (argc - 2) % 2 != 0) {
+        return 2;
+    }
+    int count = (argc - 2) / 2;
+    PatchCheck* checks = malloc(count * sizeof(PatchCheck));
+
+    int i;
+    int parsed;
+    int result = 1;
+    for (parsed = 0; parsed < count; ++parsed) {
+        if (ParsePatchCheck(argv[2+parsed*2], argv[3+parsed*2],
+                            checks+parsed) != 0) {
+            goto done;
+        }
+    }
+    result = applypatch_check_batch(count, checks) == 0 ? 0 : 1;
+
+  done:
+    for (i = 0; i < parsed; ++i) {
+        free(checks[i].patch_sha1_str);
+    }
+    free(checks);
+    return result;
+}
+
+// argv[2:] are the /cache bytes needed by each step of an install.
 int SpaceMode(int argc, char** argv) {
-    if (argc != 3) {
+    if (argc < 3) {
         return 2;
     }
-    char* endptr;
-    size_t bytes = strtol(argv[2], &endptr, 10);
-    if (bytes == 0 && endptr == argv[2]) {
-        printf("can't parse \"%s\" as byte count\n\n", argv[2]);
-        return 1;
+    int count = argc - 2;
+    size_t* bytes = malloc(count * sizeof(size_t));
+    int i;
+    for (i = 0; i < count; ++i) {
+        char* endptr;
+        bytes[i] = strtol(argv[2+i], &endptr, 10);
+        if (bytes[i] == 0 && endptr == argv[2+i]) {
+            printf("can't parse \"%s\" as byte count\n\n", argv[2+i]);
+            free(bytes);
+            return 1;
+        }
+    }
+    int result = CacheSizeCheck(count, bytes);
+    free(bytes);
+    return result;
+}
+
+// Wrap loaded file contents in a blob Value.  The Value is released
+// with free(), so mapped contents are copied out first.
+static Value* FileContentsToBlob(FileContents* fc) {
+    Value* v = malloc(sizeof(Value));
+    v->type = VAL_BLOB;
+    v->size = fc->size;
+    if (fc->mapped) {
+        v->data = malloc(fc->size);
+        memcpy(v->data, fc->data, fc->size);
+        FreeFileContents(fc);
+    } else {
+        v->data = (char*)fc->data;
     }
-    return CacheSizeCheck(bytes);
+    return v;
 }
 
 // Parse arguments (which should be of the form "<sha1>" or
@@ -77,10 +130,7 @@ static int ParsePatchArgs(int argc, char** argv,
             if (LoadFileContents(colon, &fc, RETOUCH_DONT_MASK) != 0) {
                 goto abort;
             }
-            (*patches)[i] = malloc(sizeof(Value));
-            (*patches)[i]->type = VAL_BLOB;
-            (*patches)[i]->size = fc.size;
-            (*patches)[i]->data = (char*)fc.data;
+            (*patches)[i] = FileContentsToBlob(&fc);
         }
     }
 
@@ -107,10 +157,7 @@ int PatchMode(int argc, char** argv) {
             printf("failed to load bonus file %s\n", argv[2]);
             return 1;
         }
-        bonus = malloc(sizeof(Value));
-        bonus->type = VAL_BLOB;
-        bonus->size = fc.size;
-        bonus->data = (char*)fc.data;
+        bonus = FileContentsToBlob(&fc);
         argc -= 2;
         argv += 2;
     }
@@ -185,13 +232,14 @@ int main(int argc, char** argv) {
             "usage: %s [-b <bonus-file>] <src-file> <tgt-file> <tgt-sha1> <tgt-size> "
             "[<src-sha1>:<patch> ...]\n"
             "   or  %s -c <file> [<sha1> ...]\n"
-            "   or  %s -s <bytes>\n"
+            "   or  %s -C <file> <sha1>[:<sha1>...] [<file> <sha1>[:<sha1>...] ...]\n"
+            "   or  %s -s <bytes> [<bytes> ...]\n"
             "   or  %s -l\n"
             "\n"
             "Filenames may be of the form\n"
             "  MTD:<partition>:<len_1>:<sha1_1>:<len_2>:<sha1_2>:...\n"
             "to specify reading from or writing to an MTD partition.\n\n",
-            argv[0], argv[0], argv[0], argv[0]);
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 2;
     }
 
@@ -201,6 +249,8 @@ int main(int argc, char** argv) {
         result = ShowLicenses();
     } else if (strncmp(argv[1], "-c", 3) == 0) {
         result = CheckMode(argc, argv);
+    } else if (strncmp(argv[1], "-C", 3) == 0) {
+        result = BatchCheckMode(argc, argv);
     } else if (strncmp(argv[1], "-s", 3) == 0) {
         result = SpaceMode(argc, argv);
     } else {
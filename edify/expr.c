@@ -58,9 +58,20 @@ Value* StringValue(char* str) {
     return v;
 }
 
+static const char* borrowed_addr = NULL;
+static size_t borrowed_len = 0;
+
+void SetBorrowedMemory(const void* addr, size_t len) {
+    borrowed_addr = (const char*)addr;
+    borrowed_len = len;
+}
+
 void FreeValue(Value* v) {
     if (v == NULL) return;
-    free(v->data);
+    if (v->data == NULL || v->data < borrowed_addr ||
+        v->data >= borrowed_addr + borrowed_len) {
+        free(v->data);
+    }
     free(v);
 }
 
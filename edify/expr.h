@@ -161,6 +161,11 @@ Value* ErrorAbort(State* state, const char* format, ...) __attribute__((format(p
 // Wrap a string into a Value, taking ownership of the string.
 Value* StringValue(char* str);
 
+// Let blob Values point into [addr, addr+len) (say, a mapped package)
+// rather than owning a malloc'd copy; FreeValue() leaves data in
+// that range alone.  The memory must outlive every such Value.
+void SetBorrowedMemory(const void* addr, size_t len);
+
 // Free a Value object.
 void FreeValue(Value* v);
 
@@ -221,6 +221,16 @@ really_install_package(const char *path, int* wipe_cache)
         return INSTALL_CORRUPT;
     }
 
+    /* Make sure every entry inflates cleanly before the update
+     * binary gets a chance to touch any partitions.
+     */
+    const ZipEntry* bad = mzFindCorruptZipEntry(&zip, 0);
+    if (bad != NULL) {
+        LOGE("Corrupt entry %.*s in %s\n", bad->fileNameLen, bad->fileName, path);
+        mzCloseZipArchive(&zip);
+        return INSTALL_CORRUPT;
+    }
+
     /* Verify and install the contents of the package.
      */
     ui->Print("Installing update...\n");
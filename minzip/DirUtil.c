@@ -26,6 +26,96 @@
 
 #include "DirUtil.h"
 
+/* The context last handed to setfscreatecon(), valid if gCreateConSet.
+ */
+static char *gCreateCon = NULL;
+static bool gCreateConSet = false;
+
+static void setCreateCon(const char *con)
+{
+    if (gCreateConSet) {
+        if (con == NULL && gCreateCon == NULL) {
+            return;
+        }
+        if (con != NULL && gCreateCon != NULL && strcmp(con, gCreateCon) == 0) {
+            return;
+        }
+    }
+
+    setfscreatecon((security_context_t)con);
+
+    free(gCreateCon);
+    gCreateCon = NULL;
+    gCreateConSet = true;
+    if (con != NULL) {
+        gCreateCon = strdup(con);
+        if (gCreateCon == NULL) {
+            /* Forget what we set; the next call will set it again. */
+            gCreateConSet = false;
+        }
+    }
+}
+
+void
+dirSetCreateContext(struct selabel_handle *sehnd, const char *path, int mode)
+{
+    if (sehnd == NULL) {
+        return;
+    }
+
+    char *secontext = NULL;
+    if (selabel_lookup(sehnd, &secontext, path, mode) != 0) {
+        secontext = NULL;
+    }
+    setCreateCon(secontext);
+    if (secontext != NULL) {
+        freecon(secontext);
+    }
+}
+
+bool
+dirLabelsMatch(struct selabel_handle *sehnd,
+        const char *path1, const char *path2, int mode)
+{
+    if (sehnd == NULL) {
+        return true;
+    }
+
+    char *con1 = NULL;
+    char *con2 = NULL;
+    if (selabel_lookup(sehnd, &con1, path1, mode) != 0) {
+        con1 = NULL;
+    }
+    if (selabel_lookup(sehnd, &con2, path2, mode) != 0) {
+        con2 = NULL;
+    }
+
+    bool match;
+    if (con1 == NULL || con2 == NULL) {
+        match = (con1 == con2);
+    } else {
+        match = (strcmp(con1, con2) == 0);
+    }
+    if (con1 != NULL) {
+        freecon(con1);
+    }
+    if (con2 != NULL) {
+        freecon(con2);
+    }
+    return match;
+}
+
+void
+dirClearCreateContext(void)
+{
+    if (gCreateConSet && gCreateCon != NULL) {
+        setfscreatecon(NULL);
+    }
+    free(gCreateCon);
+    gCreateCon = NULL;
+    gCreateConSet = false;
+}
+
 typedef enum { DMISSING, DDIR, DILLEGAL } DirStatus;
 
 static DirStatus
@@ -113,6 +203,8 @@ dirCreateHierarchy(const char *path, int mode,
      * If a directory already exists, no big deal.
      */
     char *p = cpath;
+    int result = 0;
+    bool labelled = false;
     while (*p != '\0') {
         /* Skip any slashes, watching out for the end of the string.
          */
@@ -140,32 +232,28 @@ dirCreateHierarchy(const char *path, int mode,
             /* Could happen if some other process/thread is
              * messing with the filesystem.
              */
-            free(cpath);
-            return -1;
+            result = -1;
+            break;
         } else if (ds == DMISSING) {
             int err;
 
-            char *secontext = NULL;
-
+            /* Directories created by one call usually share a label,
+             * so only reset the creation context once we're done.
+             */
             if (sehnd) {
-                selabel_lookup(sehnd, &secontext, cpath, mode);
-                setfscreatecon(secontext);
+                dirSetCreateContext(sehnd, cpath, mode);
+                labelled = true;
             }
 
             err = mkdir(cpath, mode);
 
-            if (secontext) {
-                freecon(secontext);
-                setfscreatecon(NULL);
-            }
-
             if (err != 0) {
-                free(cpath);
-                return -1;
+                result = -1;
+                break;
             }
             if (timestamp != NULL && utime(cpath, timestamp)) {
-                free(cpath);
-                return -1;
+                result = -1;
+                break;
             }
         }
         // else, this directory already exists.
@@ -174,9 +262,14 @@ dirCreateHierarchy(const char *path, int mode,
          */
         *p = '/';
     }
+    if (labelled) {
+        int saveErrno = errno;
+        dirClearCreateContext();
+        errno = saveErrno;
+    }
     free(cpath);
 
-    return 0;
+    return result;
 }
 
 int
@@ -44,6 +44,29 @@ int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName,
         struct selabel_handle* sehnd);
 
+/* Set the SELinux context that the next file or directory created by
+ * this process will get to whatever sehnd says "path" with "mode" should
+ * be labelled.  Does nothing if sehnd is NULL.
+ *
+ * setfscreatecon() is only called when the context actually changes,
+ * so creating a run of files that share a label (the common case for a
+ * directory tree) costs no /proc/self/attr writes after the first one.
+ * Call dirClearCreateContext() once the batch of creations is done.
+ */
+void dirSetCreateContext(struct selabel_handle *sehnd,
+        const char *path, int mode);
+
+/* Return true if sehnd would give path1 and path2 the same label for
+ * "mode".  Always true if sehnd is NULL.
+ */
+bool dirLabelsMatch(struct selabel_handle *sehnd,
+        const char *path1, const char *path2, int mode);
+
+/* Reset the creation context set by dirSetCreateContext(), so files
+ * created afterwards get the default label.
+ */
+void dirClearCreateContext(void);
+
 /* rm -rf <path>
  */
 int dirUnlinkHierarchy(const char *path);
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -731,6 +732,164 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     return true;
 }
 
+/* Size of each worker's inflate output buffer in
+ * mzFindCorruptZipEntry().
+ */
+#define INTEGRITY_BUF_SIZE (64 * 1024)
+
+/* Like mzIsZipEntryIntact(), but reads the compressed data straight
+ * from the archive mapping instead of through pArchive->fd, so it's
+ * safe to call from several threads at once.  "buf" is scratch space
+ * for inflated data.
+ */
+static bool isMappedEntryIntact(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, unsigned char *buf, size_t bufLen)
+{
+    const unsigned char *data =
+            (const unsigned char *)pArchive->map.addr + pEntry->offset;
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+
+    if (pEntry->compression == STORED) {
+        if (pEntry->compLen != pEntry->uncompLen) {
+            return false;
+        }
+        crc = crc32(crc, data, pEntry->compLen);
+    } else if (pEntry->compression == DEFLATED) {
+        z_stream zstream;
+        memset(&zstream, 0, sizeof(zstream));
+        if (inflateInit2(&zstream, -MAX_WBITS) != Z_OK) {
+            return false;
+        }
+        zstream.next_in = (Bytef *)data;
+        zstream.avail_in = pEntry->compLen;
+
+        int zerr;
+        do {
+            zstream.next_out = buf;
+            zstream.avail_out = bufLen;
+            zerr = inflate(&zstream, Z_NO_FLUSH);
+            if (zerr != Z_OK && zerr != Z_STREAM_END) {
+                break;
+            }
+            crc = crc32(crc, buf, bufLen - zstream.avail_out);
+            if (zerr == Z_OK && zstream.avail_in == 0 &&
+                    zstream.avail_out != 0) {
+                /* Ran out of input before the end of the stream. */
+                zerr = Z_DATA_ERROR;
+                break;
+            }
+        } while (zerr == Z_OK);
+        long total = zstream.total_out;
+        inflateEnd(&zstream);
+        if (zerr != Z_STREAM_END || total != pEntry->uncompLen) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    return crc == (unsigned long)pEntry->crc32;
+}
+
+typedef struct {
+    const ZipArchive *pArchive;
+    pthread_mutex_t lock;
+    unsigned int next;          /* next entry index to hand out */
+    unsigned int firstFailure;  /* lowest failing index, or numEntries */
+} IntegrityScan;
+
+static void *integrityScanThread(void *cookie)
+{
+    IntegrityScan *scan = (IntegrityScan *)cookie;
+    unsigned char *buf = (unsigned char *)malloc(INTEGRITY_BUF_SIZE);
+
+    while (true) {
+        unsigned int i;
+        bool done;
+        pthread_mutex_lock(&scan->lock);
+        i = scan->next++;
+        if (buf == NULL && i < scan->firstFailure) {
+            /* Can't check anything; report the entry we were handed
+             * so the caller doesn't mistake this for success.
+             */
+            scan->firstFailure = i;
+        }
+        /* Entries past a known failure can't change the answer. */
+        done = (i >= scan->firstFailure);
+        pthread_mutex_unlock(&scan->lock);
+
+        if (done) {
+            break;
+        }
+
+        const ZipEntry *pEntry = &scan->pArchive->pEntries[i];
+        if (!isMappedEntryIntact(scan->pArchive, pEntry, buf,
+                INTEGRITY_BUF_SIZE)) {
+            LOGW("Entry %.*s is corrupt\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            pthread_mutex_lock(&scan->lock);
+            if (i < scan->firstFailure) {
+                scan->firstFailure = i;
+            }
+            pthread_mutex_unlock(&scan->lock);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Check the CRC of every entry in the archive, spread across
+ * numThreads threads (one per online CPU if numThreads <= 0).
+ */
+const ZipEntry* mzFindCorruptZipEntry(const ZipArchive *pArchive,
+        int numThreads)
+{
+    if (numThreads <= 0) {
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (numThreads <= 0) {
+            numThreads = 1;
+        }
+    }
+    if ((unsigned int)numThreads > pArchive->numEntries) {
+        numThreads = pArchive->numEntries > 0 ? pArchive->numEntries : 1;
+    }
+
+    IntegrityScan scan;
+    scan.pArchive = pArchive;
+    pthread_mutex_init(&scan.lock, NULL);
+    scan.next = 0;
+    scan.firstFailure = pArchive->numEntries;
+
+    pthread_t *threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+    int started = 0;
+    if (threads != NULL) {
+        for (; started < numThreads - 1; ++started) {
+            if (pthread_create(&threads[started], NULL,
+                    integrityScanThread, &scan) != 0) {
+                break;
+            }
+        }
+    }
+
+    /* The calling thread works too, so this still makes progress
+     * if no threads could be started.
+     */
+    integrityScanThread(&scan);
+
+    int i;
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&scan.lock);
+
+    LOGD("Checked %u entries on %d thread(s)\n",
+            pArchive->numEntries, started + 1);
+    return mzGetZipEntryAt(pArchive, scan.firstFailure);
+}
+
 typedef struct {
     char *buf;
     int bufLen;
@@ -847,6 +1006,153 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
 }
 
 
+/*
+ * Return a STORED entry's data in place; see Zip.h.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    if (pEntry->compression != STORED || pArchive->map.addr == NULL) {
+        return NULL;
+    }
+    if (pEntry->offset < 0 || pEntry->compLen != pEntry->uncompLen ||
+        (size_t)pEntry->offset > pArchive->map.length ||
+        (size_t)pEntry->compLen > pArchive->map.length - pEntry->offset) {
+        return NULL;
+    }
+    return (const unsigned char*)pArchive->map.addr + pEntry->offset;
+}
+
+/* With MZ_EXTRACT_DEDUPE, remembers where the first copy of each
+ * distinct content was extracted to.  "path" is stored just past
+ * the struct.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    const char *path;
+} ExtractedContent;
+
+static unsigned int hashEntryContent(const ZipEntry *pEntry)
+{
+    unsigned int hash = (unsigned int)pEntry->crc32;
+    hash = hash * 31 + (unsigned int)pEntry->uncompLen;
+    hash = hash * 31 + (unsigned int)pEntry->compLen;
+    return hash;
+}
+
+/*
+ * (This is a mzHashTableLookup callback.)
+ *
+ * Two entries are candidates for sharing content if they agree on
+ * everything in the central directory that describes the data.
+ */
+static int hashcmpEntryContent(const void *tableItem, const void *looseItem)
+{
+    const ZipEntry *a = ((const ExtractedContent *)tableItem)->pEntry;
+    const ZipEntry *b = ((const ExtractedContent *)looseItem)->pEntry;
+
+    if (a->crc32 != b->crc32) {
+        return a->crc32 < b->crc32 ? -1 : 1;
+    }
+    if (a->uncompLen != b->uncompLen) {
+        return a->uncompLen < b->uncompLen ? -1 : 1;
+    }
+    if (a->compLen != b->compLen) {
+        return a->compLen < b->compLen ? -1 : 1;
+    }
+    return a->compression - b->compression;
+}
+
+/* Remember that pEntry's content now lives in "path".  Failure to
+ * remember is harmless; later copies will just be inflated again.
+ */
+static void rememberExtractedContent(HashTable *pContents,
+        const ZipEntry *pEntry, const char *path)
+{
+    size_t pathLen = strlen(path);
+    ExtractedContent *pContent =
+            (ExtractedContent *)malloc(sizeof(*pContent) + pathLen + 1);
+    if (pContent == NULL) {
+        return;
+    }
+    char *contentPath = (char *)(pContent + 1);
+    memcpy(contentPath, path, pathLen + 1);
+    pContent->pEntry = pEntry;
+    pContent->path = contentPath;
+
+    ExtractedContent *found = (ExtractedContent *)mzHashTableLookup(
+            pContents, hashEntryContent(pEntry), pContent,
+            hashcmpEntryContent, true);
+    if (found != pContent) {
+        free(pContent);
+    }
+}
+
+/* Return the previously extracted copy of pEntry's content, or NULL.
+ *
+ * Matching (crc32, lengths) is only a hint; the compressed bytes are
+ * compared in the archive mapping, which proves that the inflated
+ * bytes are equal without inflating either entry.
+ */
+static const ExtractedContent *findExtractedContent(
+        const ZipArchive *pArchive, HashTable *pContents,
+        const ZipEntry *pEntry)
+{
+    ExtractedContent key;
+    key.pEntry = pEntry;
+    key.path = NULL;
+
+    const ExtractedContent *found = (const ExtractedContent *)
+            mzHashTableLookup(pContents, hashEntryContent(pEntry), &key,
+                    hashcmpEntryContent, false);
+    if (found == NULL) {
+        return NULL;
+    }
+
+    const unsigned char *base = (const unsigned char *)pArchive->map.addr;
+    if (memcmp(base + found->pEntry->offset, base + pEntry->offset,
+            pEntry->compLen) != 0) {
+        return NULL;
+    }
+    return found;
+}
+
+/* Copy the contents of the file at srcPath to fd.  The source was
+ * written moments ago, so this reads from the page cache rather than
+ * paying for another inflate.
+ */
+static bool copyExtractedFile(const char *srcPath, int fd)
+{
+    int srcFd = open(srcPath, O_RDONLY);
+    if (srcFd < 0) {
+        LOGE("Can't open \"%s\" for copy: %s\n", srcPath, strerror(errno));
+        return false;
+    }
+
+    bool ret = true;
+    unsigned char buf[32 * 1024];
+    while (true) {
+        ssize_t n = read(srcFd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Can't read \"%s\": %s\n", srcPath, strerror(errno));
+            ret = false;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (!writeProcessFunction(buf, n, (void *)fd)) {
+            ret = false;
+            break;
+        }
+    }
+    close(srcFd);
+    return ret;
+}
+
 /* Helper state to make path translation easier and less malloc-happy.
  */
 typedef struct {
@@ -925,6 +1231,10 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
  *     /tmp/two
  *     /tmp/d/three
  *
+ * With MZ_EXTRACT_DEDUPE, each distinct content is inflated once and
+ * later identical entries are copied from the first extracted file;
+ * MZ_EXTRACT_HARDLINK hard-links them instead where the labels agree.
+ *
  * Returns true on success, false on failure.
  */
 bool mzExtractRecursive(const ZipArchive *pArchive,
@@ -986,6 +1296,18 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     bool seenMatch = false;
     int ok = true;
     int extractCount = 0;
+    char *lastDir = NULL;       // containing directory of the last file
+    int lastDirLen = -1;
+    int lastDirBufLen = 0;
+    HashTable *pContents = NULL;
+    int copyCount = 0;
+    int linkCount = 0;
+
+    if (flags & (MZ_EXTRACT_DEDUPE | MZ_EXTRACT_HARDLINK)) {
+        /* Failing to allocate this just means no deduplication.
+         */
+        pContents = mzHashTableCreate(64, free);
+    }
     for (i = 0; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
         if (pEntry->fileNameLen < zipDirLen) {
@@ -1058,15 +1380,36 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             }
         } else {
             /* This is not a directory.  First, make sure that
-             * the containing directory exists.
+             * the containing directory exists.  Archives usually
+             * list a directory's files back to back in the central
+             * directory, so skip the walk if it's the one we just made.
              */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
-            if (ret != 0) {
-                LOGE("Can't create containing directory for \"%s\": %s\n",
-                        targetFile, strerror(errno));
-                ok = false;
-                break;
+            int ret = 0;
+            const char *slash = strrchr(targetFile, '/');
+            int dirLen = slash - targetFile;
+            if (lastDirLen != dirLen ||
+                    strncmp(lastDir, targetFile, dirLen) != 0) {
+                ret = dirCreateHierarchy(
+                        targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
+                if (ret != 0) {
+                    LOGE("Can't create containing directory for \"%s\": %s\n",
+                            targetFile, strerror(errno));
+                    ok = false;
+                    break;
+                }
+                if (dirLen >= lastDirBufLen) {
+                    char *newDir = (char *)realloc(lastDir, dirLen * 2 + 1);
+                    if (newDir != NULL) {
+                        lastDir = newDir;
+                        lastDirBufLen = dirLen * 2 + 1;
+                    }
+                }
+                if (dirLen < lastDirBufLen) {
+                    memcpy(lastDir, targetFile, dirLen);
+                    lastDirLen = dirLen;
+                } else {
+                    lastDirLen = -1;
+                }
             }
 
             /* With FILES_ONLY set, we need to ignore metadata entirely,
@@ -1113,23 +1456,42 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 free(linkTarget);
             } else {
                 /* The entry is a regular file.
-                 * Open the target for writing.
+                 * See if we've already extracted the same content.
                  */
+                const ExtractedContent *pDup = NULL;
+                if (pContents != NULL && pEntry->uncompLen > 0) {
+                    pDup = findExtractedContent(pArchive, pContents, pEntry);
+                }
 
-                char *secontext = NULL;
+                /* A hard link shares the inode, and therefore the label,
+                 * with the first copy; only use one if that's the label
+                 * this path would have gotten anyway.
+                 */
+                if (pDup != NULL && (flags & MZ_EXTRACT_HARDLINK) &&
+                        dirLabelsMatch(sehnd, pDup->path, targetFile,
+                                UNZIP_FILEMODE)) {
+                    unlink(targetFile);
+                    if (link(pDup->path, targetFile) == 0) {
+                        LOGV("Linked file \"%s\" to \"%s\"\n",
+                                targetFile, pDup->path);
+                        ++linkCount;
+                        if (callback != NULL) callback(targetFile, cookie);
+                        continue;
+                    }
+                    LOGW("Can't link \"%s\" to \"%s\": %s; copying\n",
+                            targetFile, pDup->path, strerror(errno));
+                }
 
+                /* Files in the same directory almost always share a
+                 * label; the creation context is left in place between
+                 * entries and reset once after the loop.
+                 */
                 if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
+                    dirSetCreateContext(sehnd, targetFile, UNZIP_FILEMODE);
                 }
 
                 int fd = creat(targetFile, UNZIP_FILEMODE);
 
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-
                 if (fd < 0) {
                     LOGE("Can't create target file \"%s\": %s\n",
                             targetFile, strerror(errno));
@@ -1137,9 +1499,29 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                     break;
                 }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+                bool written = false;
+                if (pDup != NULL) {
+                    written = copyExtractedFile(pDup->path, fd);
+                    if (written) {
+                        ++copyCount;
+                    } else if (lseek(fd, 0, SEEK_SET) != 0 ||
+                            ftruncate(fd, 0) != 0) {
+                        LOGE("Can't rewind \"%s\": %s\n",
+                                targetFile, strerror(errno));
+                        close(fd);
+                        ok = false;
+                        break;
+                    }
+                }
+                if (!written) {
+                    written = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+                    if (written && pContents != NULL && pDup == NULL) {
+                        rememberExtractedContent(pContents, pEntry,
+                                targetFile);
+                    }
+                }
                 close(fd);
-                if (!ok) {
+                if (!written) {
                     LOGE("Error extracting \"%s\"\n", targetFile);
                     ok = false;
                     break;
@@ -1159,8 +1541,18 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (sehnd) {
+        dirClearCreateContext();
+    }
+
     LOGD("Extracted %d file(s)\n", extractCount);
+    if (pContents != NULL) {
+        LOGD("  %d of them copied and %d linked from identical entries\n",
+                copyCount, linkCount);
+        mzHashTableFree(pContents);
+    }
 
+    free(lastDir);
     free(helper.buf);
     free(zpath);
 
@@ -169,6 +169,18 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
  */
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
+/*
+ * Check the CRC on every entry in the archive, spreading the work
+ * across numThreads threads (one per online CPU if numThreads <= 0).
+ * Each thread inflates through a fixed-size buffer, so memory use
+ * doesn't depend on the size of the entries.
+ *
+ * Returns NULL if every entry is intact; otherwise returns the first
+ * corrupt entry in archive order.
+ */
+const ZipEntry* mzFindCorruptZipEntry(const ZipArchive *pArchive,
+        int numThreads);
+
 /*
  * Inflate and write an entry to a file.
  */
@@ -182,6 +194,15 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char* buffer);
 
+/*
+ * Return the uncompressed data of a STORED entry in place, inside the
+ * archive's mapping, or NULL if the entry is compressed (or doesn't
+ * lie within the mapping).  The data stays valid until the archive is
+ * closed and must not be modified.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry);
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -204,6 +225,11 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_DEDUPE - inflate byte-identical entries only once, and
+ *         produce the other copies by copying the first extracted file
+ *     MZ_EXTRACT_HARDLINK - like MZ_EXTRACT_DEDUPE, but hard-link the
+ *         copies to the first one.  Only safe if nothing will later give
+ *         the copies different owners, modes or capabilities.
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
@@ -211,7 +237,12 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum {
+    MZ_EXTRACT_FILES_ONLY = 1,
+    MZ_EXTRACT_DRY_RUN = 2,
+    MZ_EXTRACT_DEDUPE = 4,
+    MZ_EXTRACT_HARDLINK = 8,
+};
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
@@ -5,7 +5,8 @@ LOCAL_PATH := $(call my-dir)
 updater_src_files := \
 	install.c \
 	updater.c \
-	sparse.c
+	sparse.c \
+	blockimg.c
 
 #
 # Build a statically-linked binary to include in OTA packages
@@ -34,6 +35,9 @@ LOCAL_STATIC_LIBRARIES += libmincrypt libbz
 LOCAL_STATIC_LIBRARIES += libminelf
 LOCAL_STATIC_LIBRARIES += libcutils liblog libstdc++ libc
 LOCAL_STATIC_LIBRARIES += libselinux
+ifneq ($(wildcard external/lz4/lib/lz4.h),)
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
 # Each library in TARGET_RECOVERY_UPDATER_LIBS should have a function
@@ -0,0 +1,978 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Block-based updates.  Instead of patching files on a mounted
+// filesystem, block_image_update() rewrites a partition's block
+// device in place, following a "transfer list" generated at package
+// build time:
+//
+//   2                       version
+//   <blocks>                total blocks written, for progress
+//   <command> ...           one per line:
+//
+//   zero <rangeset>         fill the blocks with zeros
+//   new <rangeset>          fill the blocks from the new-data entry
+//   erase <rangeset>        discard the blocks (contents don't matter)
+//   move <sha1> <src> <tgt> copy src blocks to tgt blocks; sha1 is the
+//                           SHA-1 of the blocks being moved
+//   bsdiff <off> <len> <src-sha1> <tgt-sha1> <src> <tgt>
+//   imgdiff <off> <len> <src-sha1> <tgt-sha1> <src> <tgt>
+//                           apply the patch at [off, off+len) of the
+//                           patch-data entry to the src blocks, writing
+//                           the result to the tgt blocks
+//
+// A <rangeset> is "<n>,<start>,<end>,..." with n/2 half-open ranges
+// of BLOCKSIZE blocks.  New data is the concatenation, in command
+// order, of the contents of every "new" command's blocks; it's
+// streamed out of the package as it's needed.
+//
+// Each command reads all of its source blocks before writing any of
+// its target blocks, so a command's ranges may overlap.  Across
+// commands, sources always mean the old contents of the partition:
+// the generator orders the commands so that no block is read after
+// an earlier command has overwritten it, which is what lets the
+// partition be updated in place with no full copy.  That ordering,
+// and that no block is written by more than one command, is checked
+// here before anything is written.
+//
+// The SHA-1s make an interrupted update safe to run again.  A move or
+// patch whose source blocks don't match is skipped if its target
+// blocks already hold the result (an earlier run got that far), and
+// otherwise fails the update rather than writing garbage; a patch's
+// output is checked against the target SHA-1 as it's written.  A
+// command whose source and target overlap overwrites its own source,
+// so if it's cut off neither SHA-1 matches; its source blocks are
+// stashed in STASH_FILE before it writes anything, and a rerun that
+// finds the partition in that state loads them from there.  Zero, new
+// and erase commands read nothing from the partition, so they are
+// simply done again.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "applypatch/applypatch.h"
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "blockimg.h"
+
+#define BLOCKSIZE 4096
+
+// Source blocks of the overlapping command being written, if any.
+#define STASH_FILE "/cache/saved.blocks"
+
+typedef struct {
+    int count;          // number of ranges
+    size_t size;        // total number of blocks
+    size_t pos[0];      // start and end block of each range
+} RangeSet;
+
+// Parse a <rangeset>, rejecting any block at or past device_blocks.
+// Returns NULL on error.
+static RangeSet* ParseRangeSet(const char* text, size_t device_blocks) {
+    char* end;
+    long num = strtol(text, &end, 10);
+    if (end == text || num < 2 || num % 2 != 0 || num > 1 << 20) {
+        printf("bad range count in \"%s\"\n", text);
+        return NULL;
+    }
+
+    RangeSet* rs = malloc(sizeof(RangeSet) + num * sizeof(size_t));
+    if (rs == NULL) {
+        printf("failed to allocate range set of %ld\n", num);
+        return NULL;
+    }
+    rs->count = num / 2;
+    rs->size = 0;
+
+    int i;
+    for (i = 0; i < num; ++i) {
+        if (*end != ',') {
+            printf("too few ranges in \"%s\"\n", text);
+            free(rs);
+            return NULL;
+        }
+        const char* p = end + 1;
+        rs->pos[i] = strtoul(p, &end, 10);
+        if (end == p) {
+            printf("bad block number in \"%s\"\n", text);
+            free(rs);
+            return NULL;
+        }
+    }
+    if (*end != '\0') {
+        printf("trailing junk in range set \"%s\"\n", text);
+        free(rs);
+        return NULL;
+    }
+
+    for (i = 0; i < rs->count; ++i) {
+        size_t start = rs->pos[i*2];
+        size_t stop = rs->pos[i*2+1];
+        if (start >= stop || stop > device_blocks) {
+            printf("bad range %zu-%zu (device has %zu blocks)\n",
+                   start, stop, device_blocks);
+            free(rs);
+            return NULL;
+        }
+        rs->size += stop - start;
+    }
+    return rs;
+}
+
+static int ReadAll(int fd, unsigned char* data, size_t size, off64_t offset) {
+    while (size > 0) {
+        ssize_t n = pread64(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("read failed at %lld: %s\n", (long long)offset,
+                   n < 0 ? strerror(errno) : "end of device");
+            return -1;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int WriteAll(int fd, const unsigned char* data, size_t size,
+                    off64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite64(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("write failed at %lld: %s\n", (long long)offset,
+                   n < 0 ? strerror(errno) : "end of device");
+            return -1;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Read the blocks of 'rs', in order, into buffer.
+static int ReadBlocks(int fd, const RangeSet* rs, unsigned char* buffer) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t blocks = rs->pos[i*2+1] - rs->pos[i*2];
+        if (ReadAll(fd, buffer, blocks * BLOCKSIZE,
+                    (off64_t)rs->pos[i*2] * BLOCKSIZE) != 0) {
+            return -1;
+        }
+        buffer += blocks * BLOCKSIZE;
+    }
+    return 0;
+}
+
+// A SinkFn that writes sequentially across the blocks of a range set.
+typedef struct {
+    int fd;
+    const RangeSet* tgt;
+    int range;          // range being filled
+    size_t offset;      // bytes already written to that range
+} RangeSinkState;
+
+static ssize_t RangeSinkWrite(unsigned char* data, ssize_t size, void* token) {
+    RangeSinkState* rss = (RangeSinkState*)token;
+    ssize_t written = 0;
+
+    while (size > 0 && rss->range < rss->tgt->count) {
+        size_t start = rss->tgt->pos[rss->range*2];
+        size_t range_bytes = (rss->tgt->pos[rss->range*2+1] - start) * BLOCKSIZE;
+        size_t n = range_bytes - rss->offset;
+        if ((size_t)size < n) n = size;
+
+        if (WriteAll(rss->fd, data, n,
+                     (off64_t)start * BLOCKSIZE + rss->offset) != 0) {
+            break;
+        }
+        data += n;
+        size -= n;
+        written += n;
+        rss->offset += n;
+        if (rss->offset == range_bytes) {
+            ++rss->range;
+            rss->offset = 0;
+        }
+    }
+    return written;
+}
+
+static int RangeSinkFull(const RangeSinkState* rss) {
+    return rss->range == rss->tgt->count;
+}
+
+// New data is inflated from the package on its own thread, straight
+// into whichever "new" command's blocks the main thread has pointed
+// it at.
+typedef struct {
+    ZipArchive* za;
+    const ZipEntry* entry;
+
+    RangeSinkState* rss;    // blocks waiting for data, or NULL
+    int failed;             // a write failed
+    int done;               // the entry is exhausted (or we gave up)
+    int quit;               // main thread wants no more data
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} NewDataInfo;
+
+static bool ReceiveNewData(const unsigned char* data, int size, void* cookie) {
+    NewDataInfo* nd = (NewDataInfo*)cookie;
+
+    while (size > 0) {
+        pthread_mutex_lock(&nd->lock);
+        while (nd->rss == NULL && !nd->quit) {
+            pthread_cond_wait(&nd->cond, &nd->lock);
+        }
+        RangeSinkState* rss = nd->rss;
+        pthread_mutex_unlock(&nd->lock);
+        if (rss == NULL) {
+            return false;
+        }
+
+        ssize_t n = RangeSinkWrite((unsigned char*)data, size, rss);
+        int full = RangeSinkFull(rss);
+        if (n < size && !full) {
+            pthread_mutex_lock(&nd->lock);
+            nd->failed = 1;
+            nd->rss = NULL;
+            pthread_cond_broadcast(&nd->cond);
+            pthread_mutex_unlock(&nd->lock);
+            return false;
+        }
+        data += n;
+        size -= n;
+
+        if (full) {
+            pthread_mutex_lock(&nd->lock);
+            nd->rss = NULL;
+            pthread_cond_broadcast(&nd->cond);
+            pthread_mutex_unlock(&nd->lock);
+        }
+    }
+    return true;
+}
+
+static void* NewDataThread(void* cookie) {
+    NewDataInfo* nd = (NewDataInfo*)cookie;
+    mzProcessZipEntryContents(nd->za, nd->entry, ReceiveNewData, nd);
+
+    pthread_mutex_lock(&nd->lock);
+    nd->done = 1;
+    pthread_cond_broadcast(&nd->cond);
+    pthread_mutex_unlock(&nd->lock);
+    return NULL;
+}
+
+// Hand 'rss' to the new data thread and wait for it to be filled.
+static int WriteNewData(NewDataInfo* nd, RangeSinkState* rss) {
+    pthread_mutex_lock(&nd->lock);
+    nd->rss = rss;
+    pthread_cond_broadcast(&nd->cond);
+    while (nd->rss != NULL && !nd->done) {
+        pthread_cond_wait(&nd->cond, &nd->lock);
+    }
+    nd->rss = NULL;
+    int ok = !nd->failed && RangeSinkFull(rss);
+    pthread_mutex_unlock(&nd->lock);
+
+    if (!ok) {
+        printf("failed to write new data (%s)\n",
+               nd->failed ? "write error" : "ran out of new data");
+        return -1;
+    }
+    return 0;
+}
+
+typedef enum { CMD_ZERO, CMD_NEW, CMD_ERASE, CMD_MOVE, CMD_BSDIFF,
+               CMD_IMGDIFF } CommandType;
+
+typedef struct {
+    CommandType type;
+    RangeSet* src;          // NULL for zero, new and erase
+    RangeSet* tgt;
+    size_t patch_offset;    // bsdiff and imgdiff only
+    size_t patch_len;
+    uint8_t src_sha1[SHA_DIGEST_SIZE];  // move, bsdiff and imgdiff only
+    uint8_t tgt_sha1[SHA_DIGEST_SIZE];
+} Command;
+
+static void FreeCommands(Command* cmds, int count) {
+    int i;
+    for (i = 0; i < count; ++i) {
+        free(cmds[i].src);
+        free(cmds[i].tgt);
+    }
+    free(cmds);
+}
+
+// Parse one command line into *cmd.  'line' is modified.
+static int ParseCommand(char* line, size_t device_blocks, size_t patch_size,
+                        Command* cmd) {
+    char* save;
+    char* word = strtok_r(line, " ", &save);
+    memset(cmd, 0, sizeof(*cmd));
+
+    int has_src = 0;
+    if (word == NULL) {
+        printf("missing command\n");
+        return -1;
+    } else if (strcmp(word, "zero") == 0) {
+        cmd->type = CMD_ZERO;
+    } else if (strcmp(word, "new") == 0) {
+        cmd->type = CMD_NEW;
+    } else if (strcmp(word, "erase") == 0) {
+        cmd->type = CMD_ERASE;
+    } else if (strcmp(word, "move") == 0) {
+        cmd->type = CMD_MOVE;
+        has_src = 1;
+
+        char* sha1 = strtok_r(NULL, " ", &save);
+        if (sha1 == NULL || ParseSha1(sha1, cmd->src_sha1) != 0) {
+            printf("missing or bad move sha1\n");
+            return -1;
+        }
+        memcpy(cmd->tgt_sha1, cmd->src_sha1, SHA_DIGEST_SIZE);
+    } else if (strcmp(word, "bsdiff") == 0 || strcmp(word, "imgdiff") == 0) {
+        cmd->type = word[0] == 'b' ? CMD_BSDIFF : CMD_IMGDIFF;
+        has_src = 1;
+
+        char* offset = strtok_r(NULL, " ", &save);
+        char* len = strtok_r(NULL, " ", &save);
+        if (offset == NULL || len == NULL) {
+            printf("missing patch offset or length\n");
+            return -1;
+        }
+        cmd->patch_offset = strtoul(offset, NULL, 10);
+        cmd->patch_len = strtoul(len, NULL, 10);
+        if (cmd->patch_offset > patch_size ||
+            cmd->patch_len > patch_size - cmd->patch_offset) {
+            printf("patch %zu+%zu is past the end of the patch data (%zu)\n",
+                   cmd->patch_offset, cmd->patch_len, patch_size);
+            return -1;
+        }
+
+        char* src_sha1 = strtok_r(NULL, " ", &save);
+        char* tgt_sha1 = strtok_r(NULL, " ", &save);
+        if (src_sha1 == NULL || ParseSha1(src_sha1, cmd->src_sha1) != 0 ||
+            tgt_sha1 == NULL || ParseSha1(tgt_sha1, cmd->tgt_sha1) != 0) {
+            printf("missing or bad patch sha1s\n");
+            return -1;
+        }
+    } else {
+        printf("unknown command \"%s\"\n", word);
+        return -1;
+    }
+
+    if (has_src) {
+        char* src = strtok_r(NULL, " ", &save);
+        if (src == NULL || (cmd->src = ParseRangeSet(src, device_blocks)) == NULL) {
+            return -1;
+        }
+    }
+    char* tgt = strtok_r(NULL, " ", &save);
+    if (tgt == NULL || (cmd->tgt = ParseRangeSet(tgt, device_blocks)) == NULL) {
+        return -1;
+    }
+    if (strtok_r(NULL, " ", &save) != NULL) {
+        printf("too many arguments\n");
+        return -1;
+    }
+    if (cmd->type == CMD_MOVE && cmd->src->size != cmd->tgt->size) {
+        printf("move of %zu blocks to %zu blocks\n",
+               cmd->src->size, cmd->tgt->size);
+        return -1;
+    }
+    return 0;
+}
+
+static int TestRange(const uint8_t* bitmap, const RangeSet* rs) {
+    int i;
+    size_t b;
+    for (i = 0; i < rs->count; ++i) {
+        for (b = rs->pos[i*2]; b < rs->pos[i*2+1]; ++b) {
+            if (bitmap[b / 8] & (1 << (b % 8))) return 1;
+        }
+    }
+    return 0;
+}
+
+static void MarkRange(uint8_t* bitmap, const RangeSet* rs) {
+    int i;
+    size_t b;
+    for (i = 0; i < rs->count; ++i) {
+        for (b = rs->pos[i*2]; b < rs->pos[i*2+1]; ++b) {
+            bitmap[b / 8] |= 1 << (b % 8);
+        }
+    }
+}
+
+// Parse the whole transfer list and check it against the device
+// before anything is written.  On success stores the commands, the
+// total block count from the header and the largest source (in
+// blocks) and returns the number of commands; returns -1 on error.
+static int ParseTransferList(char* text, size_t device_blocks,
+                             size_t patch_size, Command** commands,
+                             size_t* total_blocks, size_t* max_src) {
+    char* save;
+    char* line = strtok_r(text, "\n", &save);
+    if (line == NULL || strcmp(line, "2") != 0) {
+        printf("unsupported transfer list version \"%s\"\n",
+               line ? line : "");
+        return -1;
+    }
+    line = strtok_r(NULL, "\n", &save);
+    if (line == NULL) {
+        printf("transfer list is missing the block count\n");
+        return -1;
+    }
+    *total_blocks = strtoul(line, NULL, 10);
+    *max_src = 0;
+
+    uint8_t* written = calloc((device_blocks + 7) / 8, 1);
+    int alloc = 64;
+    int count = 0;
+    Command* cmds = malloc(alloc * sizeof(Command));
+    if (written == NULL || cmds == NULL) {
+        printf("failed to allocate transfer list state\n");
+        free(written);
+        free(cmds);
+        return -1;
+    }
+
+    while ((line = strtok_r(NULL, "\n", &save)) != NULL) {
+        if (count == alloc) {
+            alloc *= 2;
+            Command* grown = realloc(cmds, alloc * sizeof(Command));
+            if (grown == NULL) {
+                printf("failed to allocate transfer list state\n");
+                goto fail;
+            }
+            cmds = grown;
+        }
+        Command* cmd = cmds + count;
+        if (ParseCommand(line, device_blocks, patch_size, cmd) != 0) {
+            printf("bad transfer list command %d\n", count);
+            free(cmd->src);
+            free(cmd->tgt);
+            goto fail;
+        }
+        ++count;
+
+        if (cmd->src != NULL) {
+            if (TestRange(written, cmd->src)) {
+                printf("transfer list command %d reads blocks written by "
+                       "an earlier command\n", count-1);
+                goto fail;
+            }
+            if (cmd->src->size > *max_src) {
+                *max_src = cmd->src->size;
+            }
+        }
+        // Running the list again redoes zero, new and erase commands,
+        // which mustn't clobber another command's finished output.
+        if (TestRange(written, cmd->tgt)) {
+            printf("transfer list command %d writes blocks written by "
+                   "an earlier command\n", count-1);
+            goto fail;
+        }
+        MarkRange(written, cmd->tgt);
+    }
+
+    free(written);
+    *commands = cmds;
+    return count;
+
+  fail:
+    free(written);
+    FreeCommands(cmds, count);
+    return -1;
+}
+
+// Blocks per read or write when streaming over a range set.
+#define IO_BLOCKS 64
+
+static int ZeroBlocks(int fd, const RangeSet* rs) {
+    static const unsigned char zeros[IO_BLOCKS * BLOCKSIZE];
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t b = rs->pos[i*2];
+        while (b < rs->pos[i*2+1]) {
+            size_t n = rs->pos[i*2+1] - b;
+            if (n > IO_BLOCKS) n = IO_BLOCKS;
+            if (WriteAll(fd, zeros, n * BLOCKSIZE, (off64_t)b * BLOCKSIZE) != 0) {
+                return -1;
+            }
+            b += n;
+        }
+    }
+    return 0;
+}
+
+static void EraseBlocks(int fd, const RangeSet* rs) {
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        uint64_t range[2];
+        range[0] = (uint64_t)rs->pos[i*2] * BLOCKSIZE;
+        range[1] = (uint64_t)(rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (ioctl(fd, BLKDISCARD, &range) < 0) {
+            // Erasing only saves the device some work later; blocks
+            // we can't discard just keep their old contents.
+            printf("    discard of blocks %zu-%zu failed: %s\n",
+                   rs->pos[i*2], rs->pos[i*2+1], strerror(errno));
+            return;
+        }
+    }
+}
+
+// Compute the SHA-1 of the blocks of 'rs', in order.
+static int HashBlocks(int fd, const RangeSet* rs, uint8_t* digest) {
+    unsigned char* buffer = malloc(IO_BLOCKS * BLOCKSIZE);
+    if (buffer == NULL) {
+        printf("failed to allocate hash buffer\n");
+        return -1;
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    int i;
+    size_t b, n;
+    for (i = 0; i < rs->count; ++i) {
+        for (b = rs->pos[i*2]; b < rs->pos[i*2+1]; b += n) {
+            n = rs->pos[i*2+1] - b;
+            if (n > IO_BLOCKS) n = IO_BLOCKS;
+            if (ReadAll(fd, buffer, n * BLOCKSIZE, (off64_t)b * BLOCKSIZE) != 0) {
+                free(buffer);
+                return -1;
+            }
+            SHA_update(&ctx, buffer, n * BLOCKSIZE);
+        }
+    }
+    memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    free(buffer);
+    return 0;
+}
+
+static int RangesOverlap(const RangeSet* a, const RangeSet* b) {
+    int i, j;
+    for (i = 0; i < a->count; ++i) {
+        for (j = 0; j < b->count; ++j) {
+            if (a->pos[i*2] < b->pos[j*2+1] && b->pos[j*2] < a->pos[i*2+1]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Save the source blocks of an overlapping command (already read into
+// buffer) to STASH_FILE, durably, before any of them is overwritten.
+static int StashSource(const unsigned char* buffer, size_t size) {
+    if (MakeFreeSpaceOnCache(size) < 0) {
+        printf("not enough free space on /cache to stash %zu bytes\n", size);
+        return -1;
+    }
+    int fd = open(STASH_FILE, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        printf("failed to open %s: %s\n", STASH_FILE, strerror(errno));
+        return -1;
+    }
+    if (WriteAll(fd, buffer, size, 0) != 0 || fsync(fd) != 0) {
+        printf("failed to write %s: %s\n", STASH_FILE, strerror(errno));
+        close(fd);
+        unlink(STASH_FILE);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Load the stashed source of 'cmd' into buffer.  Returns 0 if the
+// stash holds exactly the blocks the command's source SHA-1 names.
+static int LoadStash(const Command* cmd, unsigned char* buffer) {
+    size_t size = cmd->src->size * BLOCKSIZE;
+    struct stat st;
+    int fd = open(STASH_FILE, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != size ||
+        ReadAll(fd, buffer, size, 0) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    SHA_hash(buffer, size, digest);
+    return memcmp(digest, cmd->src_sha1, SHA_DIGEST_SIZE) == 0 ? 0 : -1;
+}
+
+// Read the source blocks of a move or patch command into buffer.
+// Returns 0 if they (or, for a command cut off while overwriting its
+// own source, the stashed copy of them) match the command's source
+// SHA-1, 1 if they don't but the target blocks already hold the
+// command's output, and -1 if none of those (or on error).
+static int LoadSource(int fd, const Command* cmd, int index,
+                      unsigned char* buffer) {
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (ReadBlocks(fd, cmd->src, buffer) != 0) {
+        return -1;
+    }
+    SHA_hash(buffer, cmd->src->size * BLOCKSIZE, digest);
+    if (memcmp(digest, cmd->src_sha1, SHA_DIGEST_SIZE) == 0) {
+        return 0;
+    }
+    if (HashBlocks(fd, cmd->tgt, digest) == 0 &&
+        memcmp(digest, cmd->tgt_sha1, SHA_DIGEST_SIZE) == 0) {
+        printf("    command %d already done\n", index);
+        return 1;
+    }
+    if (RangesOverlap(cmd->src, cmd->tgt) && LoadStash(cmd, buffer) == 0) {
+        printf("    resuming command %d from stashed source\n", index);
+        return 0;
+    }
+    printf("source blocks of command %d don't match, and its target "
+           "blocks don't hold its output\n", index);
+    return -1;
+}
+
+// block_image_update(block_device, transfer_list, new_data_entry,
+//                    patch_data_entry)
+//
+// Rewrites block_device as directed by transfer_list (a blob, usually
+// from package_extract_file()), taking new data and patches from the
+// named package entries.  Returns "t" on success and "" on failure.
+Value* BlockImageUpdateFn(const char* name, State* state,
+                          int argc, Expr* argv[]) {
+    if (argc != 4) {
+        return ErrorAbort(state, "%s() expects 4 args, got %d", name, argc);
+    }
+
+    Value* blockdev_filename;
+    Value* transfer_list_value;
+    Value* new_data_fn;
+    Value* patch_data_fn;
+    if (ReadValueArgs(state, argv, 4, &blockdev_filename,
+                      &transfer_list_value, &new_data_fn,
+                      &patch_data_fn) < 0) {
+        return NULL;
+    }
+
+    int success = 0;
+    int fd = -1;
+    char* transfer_list = NULL;
+    Command* cmds = NULL;
+    int num_cmds = 0;
+    const unsigned char* patch_data = NULL;
+    unsigned char* patch_copy = NULL;
+    unsigned char* buffer = NULL;
+    int thread_started = 0;
+    pthread_t new_thread;
+    NewDataInfo nd;
+
+    if (blockdev_filename->type != VAL_STRING) {
+        ErrorAbort(state, "%s(): block device must be a string", name);
+        goto done;
+    }
+    if (transfer_list_value->type != VAL_BLOB) {
+        ErrorAbort(state, "%s(): transfer list must be a blob", name);
+        goto done;
+    }
+    if (new_data_fn->type != VAL_STRING || patch_data_fn->type != VAL_STRING) {
+        ErrorAbort(state, "%s(): new and patch data entries must be strings",
+                   name);
+        goto done;
+    }
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    ZipArchive* za = ui->package_zip;
+    const ZipEntry* new_entry = mzFindZipEntry(za, new_data_fn->data);
+    if (new_entry == NULL) {
+        printf("%s(): no %s in package\n", name, new_data_fn->data);
+        goto done;
+    }
+    const ZipEntry* patch_entry = mzFindZipEntry(za, patch_data_fn->data);
+    if (patch_entry == NULL) {
+        printf("%s(): no %s in package\n", name, patch_data_fn->data);
+        goto done;
+    }
+
+    fd = open(blockdev_filename->data, O_RDWR);
+    if (fd < 0) {
+        printf("%s(): failed to open %s: %s\n", name,
+               blockdev_filename->data, strerror(errno));
+        goto done;
+    }
+    off64_t device_size = lseek64(fd, 0, SEEK_END);
+    if (device_size < 0) {
+        printf("%s(): failed to size %s: %s\n", name,
+               blockdev_filename->data, strerror(errno));
+        goto done;
+    }
+    size_t device_blocks = device_size / BLOCKSIZE;
+
+    // strtok needs a terminated, writable copy.
+    transfer_list = malloc(transfer_list_value->size + 1);
+    if (transfer_list == NULL) {
+        printf("%s(): failed to copy transfer list\n", name);
+        goto done;
+    }
+    memcpy(transfer_list, transfer_list_value->data, transfer_list_value->size);
+    transfer_list[transfer_list_value->size] = '\0';
+
+    size_t patch_size = mzGetZipEntryUncompLen(patch_entry);
+    size_t total_blocks, max_src;
+    num_cmds = ParseTransferList(transfer_list, device_blocks, patch_size,
+                                 &cmds, &total_blocks, &max_src);
+    if (num_cmds < 0) {
+        num_cmds = 0;
+        goto done;
+    }
+
+    // The patch data is normally stored, so it can be used in place;
+    // otherwise inflate it into memory.
+    patch_data = mzGetStoredZipEntryData(za, patch_entry);
+    if (patch_data == NULL) {
+        patch_copy = malloc(patch_size > 0 ? patch_size : 1);
+        patch_data = patch_copy;
+    }
+    buffer = malloc(max_src > 0 ? max_src * BLOCKSIZE : 1);
+    if (patch_data == NULL || buffer == NULL) {
+        printf("%s(): failed to allocate %zu bytes of patch data and %zu "
+               "blocks of source buffer\n", name, patch_size, max_src);
+        goto done;
+    }
+    if (patch_copy != NULL && patch_size > 0 &&
+        !mzExtractZipEntryToBuffer(za, patch_entry, patch_copy)) {
+        printf("%s(): failed to extract %s\n", name, patch_data_fn->data);
+        goto done;
+    }
+
+    memset(&nd, 0, sizeof(nd));
+    nd.za = za;
+    nd.entry = new_entry;
+    pthread_mutex_init(&nd.lock, NULL);
+    pthread_cond_init(&nd.cond, NULL);
+    if (pthread_create(&new_thread, NULL, NewDataThread, &nd) != 0) {
+        printf("%s(): failed to start new data thread\n", name);
+        pthread_mutex_destroy(&nd.lock);
+        pthread_cond_destroy(&nd.cond);
+        goto done;
+    }
+    thread_started = 1;
+
+    size_t blocks_so_far = 0;
+    int i;
+    for (i = 0; i < num_cmds; ++i) {
+        Command* cmd = cmds + i;
+        RangeSinkState rss;
+        rss.fd = fd;
+        rss.tgt = cmd->tgt;
+        rss.range = 0;
+        rss.offset = 0;
+        int loaded = 0;
+        int stashed = 0;
+
+        if (cmd->src != NULL) {
+            loaded = LoadSource(fd, cmd, i, buffer);
+            if (loaded < 0) goto done;
+            if (loaded == 0 && RangesOverlap(cmd->src, cmd->tgt)) {
+                if (StashSource(buffer, cmd->src->size * BLOCKSIZE) != 0) {
+                    goto done;
+                }
+                stashed = 1;
+            }
+        }
+
+        switch (cmd->type) {
+            case CMD_ZERO:
+                if (ZeroBlocks(fd, cmd->tgt) != 0) goto done;
+                break;
+
+            case CMD_NEW:
+                if (WriteNewData(&nd, &rss) != 0) goto done;
+                break;
+
+            case CMD_ERASE:
+                EraseBlocks(fd, cmd->tgt);
+                break;
+
+            case CMD_MOVE:
+                if (loaded > 0) break;
+                RangeSinkWrite(buffer, cmd->src->size * BLOCKSIZE, &rss);
+                break;
+
+            case CMD_BSDIFF:
+            case CMD_IMGDIFF: {
+                if (loaded > 0) break;
+
+                Value patch_value;
+                patch_value.type = VAL_BLOB;
+                patch_value.size = cmd->patch_len;
+                patch_value.data = (char*)patch_data + cmd->patch_offset;
+
+                SHA_CTX ctx;
+                SHA_init(&ctx);
+                int result;
+                if (cmd->type == CMD_BSDIFF) {
+                    result = ApplyBSDiffPatch(buffer, cmd->src->size * BLOCKSIZE,
+                                              &patch_value, 0,
+                                              RangeSinkWrite, &rss, &ctx);
+                } else {
+                    result = ApplyImagePatch(buffer, cmd->src->size * BLOCKSIZE,
+                                             &patch_value,
+                                             RangeSinkWrite, &rss, &ctx, NULL);
+                }
+                if (result != 0) {
+                    printf("%s(): patch of command %d failed\n", name, i);
+                    goto done;
+                }
+                if (memcmp(SHA_final(&ctx), cmd->tgt_sha1,
+                           SHA_DIGEST_SIZE) != 0) {
+                    printf("%s(): command %d output doesn't match its "
+                           "sha1\n", name, i);
+                    goto done;
+                }
+                break;
+            }
+        }
+
+        if ((cmd->type == CMD_MOVE || cmd->type == CMD_BSDIFF ||
+             cmd->type == CMD_IMGDIFF) && loaded == 0 && !RangeSinkFull(&rss)) {
+            printf("%s(): command %d didn't fill its %zu target blocks\n",
+                   name, i, cmd->tgt->size);
+            goto done;
+        }
+
+        // The stash can go once the command's output is on the device.
+        if (stashed) {
+            if (fsync(fd) != 0) {
+                printf("%s(): fsync of %s failed: %s\n", name,
+                       blockdev_filename->data, strerror(errno));
+                goto done;
+            }
+            unlink(STASH_FILE);
+        }
+
+        if (cmd->type != CMD_ERASE && total_blocks > 0) {
+            blocks_so_far += cmd->tgt->size;
+            fprintf(ui->cmd_pipe, "set_progress %.4f\n",
+                    (double)blocks_so_far / total_blocks);
+        }
+    }
+
+    if (fsync(fd) != 0) {
+        printf("%s(): fsync of %s failed: %s\n", name,
+               blockdev_filename->data, strerror(errno));
+        goto done;
+    }
+    printf("wrote %zu blocks to %s\n", blocks_so_far, blockdev_filename->data);
+    success = 1;
+
+  done:
+    if (thread_started) {
+        pthread_mutex_lock(&nd.lock);
+        nd.quit = 1;
+        pthread_cond_broadcast(&nd.cond);
+        pthread_mutex_unlock(&nd.lock);
+        pthread_join(new_thread, NULL);
+        pthread_mutex_destroy(&nd.lock);
+        pthread_cond_destroy(&nd.cond);
+    }
+    if (fd >= 0) close(fd);
+    FreeCommands(cmds, num_cmds);
+    free(transfer_list);
+    free(patch_copy);
+    free(buffer);
+    FreeValue(blockdev_filename);
+    FreeValue(transfer_list_value);
+    FreeValue(new_data_fn);
+    FreeValue(patch_data_fn);
+    return StringValue(strdup(success ? "t" : ""));
+}
+
+// range_sha1(block_device, rangeset)
+//
+// Returns the hex SHA-1 of the given blocks of block_device, so that
+// scripts can check a partition before (or after) updating it.
+Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+
+    char* blockdev_filename;
+    char* ranges;
+    if (ReadArgs(state, argv, 2, &blockdev_filename, &ranges) < 0) {
+        return NULL;
+    }
+
+    Value* result = NULL;
+    RangeSet* rs = NULL;
+
+    int fd = open(blockdev_filename, O_RDONLY);
+    if (fd < 0) {
+        ErrorAbort(state, "%s(): failed to open %s: %s", name,
+                   blockdev_filename, strerror(errno));
+        goto done;
+    }
+    off64_t device_size = lseek64(fd, 0, SEEK_END);
+    rs = ParseRangeSet(ranges, device_size < 0 ? 0 : device_size / BLOCKSIZE);
+    if (rs == NULL) {
+        ErrorAbort(state, "%s(): bad range set \"%s\"", name, ranges);
+        goto done;
+    }
+
+    uint8_t digest[SHA_DIGEST_SIZE];
+    if (HashBlocks(fd, rs, digest) != 0) {
+        ErrorAbort(state, "%s(): failed to read %s", name, blockdev_filename);
+        goto done;
+    }
+
+    int i;
+    char* hex = malloc(SHA_DIGEST_SIZE * 2 + 1);
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        sprintf(hex + i*2, "%02x", digest[i]);
+    }
+    result = StringValue(hex);
+
+  done:
+    if (fd >= 0) close(fd);
+    free(rs);
+    free(blockdev_filename);
+    free(ranges);
+    return result;
+}
+
+void RegisterBlockImageFunctions() {
+    RegisterFunction("block_image_update", BlockImageUpdateFn);
+    RegisterFunction("range_sha1", RangeSha1Fn);
+}
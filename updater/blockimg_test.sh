@@ -0,0 +1,201 @@
+#!/bin/bash
+#
+# A test suite for block_image_update().  Run in a client where you
+# have done envsetup, choosecombo, etc.
+#
+# The "partition" updated is a file in WORK_DIR, so this doesn't touch
+# any real partitions, but it does run the updater as root.
+#
+# TODO: find some way to get this run regularly along with the rest of
+# the tests.
+
+EMULATOR_PORT=5580
+
+# Put all binaries and files here.
+WORK_DIR=/data/local/tmp/blockimg
+
+# set to 0 to use a device instead
+USE_EMULATOR=1
+
+# ------------------------
+
+tmpdir=$(mktemp -d)
+
+if [ "$USE_EMULATOR" == 1 ]; then
+  emulator -wipe-data -noaudio -no-window -port $EMULATOR_PORT &
+  pid_emulator=$!
+  ADB="adb -s emulator-$EMULATOR_PORT "
+else
+  ADB="adb -d "
+fi
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+echo "device is available"
+$ADB root
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+testname() {
+  echo
+  echo "$1"...
+  testname="$1"
+}
+
+fail() {
+  echo
+  echo FAIL: $testname
+  echo
+  [ "$pid_emulator" == "" ] || kill $pid_emulator
+  exit 1
+}
+
+sha1() {
+  sha1sum $1 | awk '{print $1}'
+}
+
+# blocks <file> <start> <end>: the 4k blocks [start, end) of file
+blocks() {
+  dd if=$1 bs=4096 skip=$2 count=$(($3 - $2)) 2>/dev/null
+}
+
+# put <file> <start> <data-file>: overwrite file from block start
+put() {
+  dd if=$3 of=$1 bs=4096 seek=$2 conv=notrunc 2>/dev/null
+}
+
+cleanup() {
+  testname "removing test files"
+  run_command rm -r $WORK_DIR
+
+  [ "$pid_emulator" == "" ] || kill $pid_emulator
+
+  if [ $# == 0 ]; then
+    rm -rf $tmpdir
+  fi
+}
+
+# ------------------------
+# Build the old and new images and the packages that update one to
+# the other.  The transfer list exercises every command:
+#
+#   imgdiff  blocks 0-32 (edited)   -> 128-160
+#   move     blocks 64-96           -> 0-32
+#   move     blocks 160-192         -> 168-200   (overlapping, in place)
+#   new      data                   -> 32-64
+#   zero                            -> 64-96
+#   erase                           -> 240-256
+
+cd $tmpdir
+dd if=/dev/urandom of=old.img bs=4096 count=256 2>/dev/null
+cp old.img new.img
+
+blocks old.img 0 32 > src0
+cp src0 tgt0
+printf 'changed' | dd of=tgt0 bs=1 seek=5000 conv=notrunc 2>/dev/null
+$ANDROID_HOST_OUT/bin/imgdiff src0 tgt0 patch0 > /dev/null || fail
+put new.img 128 tgt0
+
+blocks old.img 64 96 > mv1
+put new.img 0 mv1
+blocks old.img 160 192 > mv2
+put new.img 168 mv2
+
+dd if=/dev/urandom of=new.dat bs=4096 count=32 2>/dev/null
+put new.img 32 new.dat
+dd if=/dev/zero of=zeros bs=4096 count=32 2>/dev/null
+put new.img 64 zeros
+
+cat > commands <<EOF
+imgdiff 0 $(stat -c %s patch0) $(sha1 src0) $(sha1 tgt0) 2,0,32 2,128,160
+move $(sha1 mv1) 2,64,96 2,0,32
+move $(sha1 mv2) 2,160,192 2,168,200
+new 2,32,64
+zero 2,64,96
+erase 2,240,256
+EOF
+
+# make_package <name> <number of commands>
+make_package() {
+  mkdir -p $1/META-INF/com/google/android
+  (echo 2; echo 160; head -$2 commands) > $1/system.transfer.list
+  cp new.dat $1/system.new.dat
+  cp patch0 $1/system.patch.dat
+  cat > $1/META-INF/com/google/android/updater-script <<EOF
+block_image_update("$WORK_DIR/part.img",
+                   package_extract_file("system.transfer.list"),
+                   "system.new.dat", "system.patch.dat") ||
+    abort("block_image_update failed");
+EOF
+  (cd $1 && zip -q -r ../$1.zip .)
+}
+
+make_package full 6
+make_package partial 2
+cd - > /dev/null
+
+cleanup leave_tmp
+
+run_command mkdir -p $WORK_DIR
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/updater $WORK_DIR/updater
+$ADB push $tmpdir/full.zip $WORK_DIR
+$ADB push $tmpdir/partial.zip $WORK_DIR
+
+# run_update <package>
+run_update() {
+  run_command $WORK_DIR/updater 3 1 $WORK_DIR/$1
+}
+
+# --------------- update ----------------------
+
+testname "update"
+$ADB push $tmpdir/old.img $WORK_DIR/part.img
+run_update full.zip || fail
+$ADB pull $WORK_DIR/part.img $tmpdir/result.img
+blocks $tmpdir/result.img 0 240 | cmp -s - <(blocks $tmpdir/new.img 0 240) || fail
+
+testname "update already updated partition"
+run_update full.zip || fail
+$ADB pull $WORK_DIR/part.img $tmpdir/result.img
+blocks $tmpdir/result.img 0 240 | cmp -s - <(blocks $tmpdir/new.img 0 240) || fail
+
+testname "resume interrupted update"
+$ADB push $tmpdir/old.img $WORK_DIR/part.img
+run_update partial.zip || fail
+run_update full.zip || fail
+$ADB pull $WORK_DIR/part.img $tmpdir/result.img
+blocks $tmpdir/result.img 0 240 | cmp -s - <(blocks $tmpdir/new.img 0 240) || fail
+
+testname "resume interrupted overlapping move"
+# Stop part way through the in-place move of blocks 160-192 to
+# 168-200: neither hash matches any more, so the rerun has to use the
+# source blocks stashed on /cache.
+$ADB push $tmpdir/old.img $WORK_DIR/part.img
+run_update partial.zip || fail
+$ADB pull $WORK_DIR/part.img $tmpdir/cut.img
+blocks $tmpdir/old.img 160 192 > $tmpdir/stash
+blocks $tmpdir/old.img 160 176 > $tmpdir/half
+put $tmpdir/cut.img 168 $tmpdir/half
+$ADB push $tmpdir/cut.img $WORK_DIR/part.img
+$ADB push $tmpdir/stash /cache/saved.blocks
+run_update full.zip || fail
+$ADB pull $WORK_DIR/part.img $tmpdir/result.img
+blocks $tmpdir/result.img 0 240 | cmp -s - <(blocks $tmpdir/new.img 0 240) || fail
+
+testname "update with bad source fails"
+cp $tmpdir/old.img $tmpdir/bad.img
+printf 'junk' | dd of=$tmpdir/bad.img bs=1 seek=$((70 * 4096)) conv=notrunc 2>/dev/null
+$ADB push $tmpdir/bad.img $WORK_DIR/part.img
+run_update full.zip && fail
+
+# --------------- cleanup ----------------------
+
+cleanup
+
+echo
+echo PASS
+echo
@@ -84,18 +84,14 @@ Value* MountFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
-    char *secontext = NULL;
-
     if (sehandle) {
-        selabel_lookup(sehandle, &secontext, mount_point, 0755);
-        setfscreatecon(secontext);
+        dirSetCreateContext(sehandle, mount_point, 0755);
     }
 
     mkdir(mount_point, 0755);
 
-    if (secontext) {
-        freecon(secontext);
-        setfscreatecon(NULL);
+    if (sehandle) {
+        dirClearCreateContext();
     }
 
     if (strcmp(partition_type, "MTD") == 0) {
@@ -408,14 +404,41 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 // package_extract_dir(package_path, destination_path)
+//   or
+// package_extract_dir(package_path, destination_path, "hardlink")
+//   Identical files in the package are only inflated once either way.
+//   With "hardlink" the duplicates become hard links to the first
+//   copy, so only pass it if the script won't set_perm/set_metadata
+//   the copies differently afterwards.
 Value* PackageExtractDirFn(const char* name, State* state,
                           int argc, Expr* argv[]) {
-    if (argc != 2) {
-        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    if (argc != 2 && argc != 3) {
+        return ErrorAbort(state, "%s() expects 2 or 3 args, got %d",
+                          name, argc);
     }
     char* zip_path;
     char* dest_path;
-    if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+    char* mode = NULL;
+    if (argc == 3) {
+        if (ReadArgs(state, argv, 3, &zip_path, &dest_path, &mode) < 0) {
+            return NULL;
+        }
+    } else {
+        if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
+    }
+
+    int flags = MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_DEDUPE;
+    if (mode != NULL) {
+        if (strcmp(mode, "hardlink") != 0) {
+            ErrorAbort(state, "%s: unknown extraction mode \"%s\"",
+                       name, mode);
+            free(zip_path);
+            free(dest_path);
+            free(mode);
+            return NULL;
+        }
+        flags |= MZ_EXTRACT_HARDLINK;
+    }
 
     ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
 
@@ -423,14 +446,34 @@ Value* PackageExtractDirFn(const char* name, State* state,
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                      flags, &timestamp,
                                       NULL, NULL, sehandle);
     free(zip_path);
     free(dest_path);
+    free(mode);
     return StringValue(strdup(success ? "t" : ""));
 }
 
 
+// package_verify_entries()
+//   Checks the CRC of every entry in the package, in parallel, and
+//   aborts naming the first corrupt one.  Meant to run before
+//   anything irreversible is written.
+Value* PackageVerifyEntriesFn(const char* name, State* state,
+                              int argc, Expr* argv[]) {
+    if (argc != 0) {
+        return ErrorAbort(state, "%s() expects no args, got %d", name, argc);
+    }
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* bad = mzFindCorruptZipEntry(za, 0);
+    if (bad != NULL) {
+        return ErrorAbort(state, "%s: %.*s is corrupt", name,
+                          bad->fileNameLen, bad->fileName);
+    }
+    return StringValue(strdup("t"));
+}
+
 // package_extract_file(package_path, destination_path)
 //   or
 // package_extract_file(package_path)
@@ -490,6 +533,16 @@ Value* PackageExtractFileFn(const char* name, State* state,
         }
 
         v->size = mzGetZipEntryUncompLen(entry);
+
+        // A stored entry is used in place, straight out of the package
+        // mapping (which updater.c registers with SetBorrowedMemory()).
+        const unsigned char* stored = mzGetStoredZipEntryData(za, entry);
+        if (stored != NULL) {
+            v->data = (char*)stored;
+            success = true;
+            goto done1;
+        }
+
         v->data = malloc(v->size);
         if (v->data == NULL) {
             printf("%s: failed to allocate %ld bytes for %s\n",
@@ -1202,26 +1255,50 @@ done:
 }
 
 // apply_patch_space(bytes)
+// apply_patch_space(bytes_1, bytes_2, ...)
+//
+// Makes room on /cache for a sequence of patches needing bytes_i each.
+// Passing every step at once lets the space be planned (and any
+// expendable files deleted) in one pass.
 Value* ApplyPatchSpaceFn(const char* name, State* state,
                          int argc, Expr* argv[]) {
-    char* bytes_str;
-    if (ReadArgs(state, argv, 1, &bytes_str) < 0) {
+    if (argc < 1) {
+        return ErrorAbort(state, "%s(): expected at least 1 arg, got %d",
+                          name, argc);
+    }
+
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) {
         return NULL;
     }
 
-    char* endptr;
-    size_t bytes = strtol(bytes_str, &endptr, 10);
-    if (bytes == 0 && endptr == bytes_str) {
-        ErrorAbort(state, "%s(): can't parse \"%s\" as byte count\n\n",
-                   name, bytes_str);
-        free(bytes_str);
+    size_t* bytes = malloc(argc * sizeof(size_t));
+    int i;
+    for (i = 0; i < argc; ++i) {
+        char* endptr;
+        bytes[i] = strtol(args[i], &endptr, 10);
+        if (bytes[i] == 0 && endptr == args[i]) {
+            ErrorAbort(state, "%s(): can't parse \"%s\" as byte count\n\n",
+                       name, args[i]);
+            break;
+        }
+    }
+    int parsed = i;
+
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    if (parsed < argc) {
+        free(bytes);
         return NULL;
     }
 
-    return StringValue(strdup(CacheSizeCheck(bytes) ? "" : "t"));
+    int result = CacheSizeCheck(argc, bytes);
+    free(bytes);
+    return StringValue(strdup(result ? "" : "t"));
 }
 
-
 // apply_patch(srcfile, tgtfile, tgtsha1, tgtsize, sha1_1, patch_1, ...)
 Value* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc < 6 || (argc % 2) == 1) {
@@ -1321,6 +1398,51 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
 
+// apply_patch_check_all(file1, sha1_list1, file2, sha1_list2, ...)
+//
+// Like apply_patch_check() on each file, but the checks run in
+// parallel.  Each sha1_list is a colon-separated list of sha1s (or
+// empty).  Returns "t" if every file passes; the failing files are
+// all logged.
+Value* ApplyPatchCheckAllFn(const char* name, State* state,
+                            int argc, Expr* argv[]) {
+    if (argc < 2 || argc % 2 != 0) {
+        return ErrorAbort(state, "%s(): expected file/sha1 pairs, got %d args",
+                          name, argc);
+    }
+
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) {
+        return NULL;
+    }
+
+    int count = argc / 2;
+    PatchCheck* checks = malloc(count * sizeof(PatchCheck));
+    int i;
+    int parsed;
+    int failures = count;
+    for (parsed = 0; parsed < count; ++parsed) {
+        if (ParsePatchCheck(args[parsed*2], args[parsed*2+1],
+                            checks+parsed) != 0) {
+            break;
+        }
+    }
+    if (parsed == count) {
+        failures = applypatch_check_batch(count, checks);
+    }
+
+    for (i = 0; i < parsed; ++i) {
+        free(checks[i].patch_sha1_str);
+    }
+    free(checks);
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+
+    return StringValue(strdup(failures == 0 ? "t" : ""));
+}
+
 Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) {
@@ -1501,7 +1623,20 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     v->size = fc.size;
-    v->data = (char*)fc.data;
+    if (fc.mapped) {
+        // The script owns (and will free()) the blob, so it can't be
+        // a mapping of the file or partition.
+        v->data = malloc(fc.size);
+        if (v->data != NULL) memcpy(v->data, fc.data, fc.size);
+        FreeFileContents(&fc);
+        if (v->data == NULL) {
+            free(filename);
+            free(v);
+            return ErrorAbort(state, "%s() out of memory", name);
+        }
+    } else {
+        v->data = (char*)fc.data;
+    }
 
     free(filename);
     return v;
@@ -1518,6 +1653,7 @@ void RegisterInstallFunctions() {
     RegisterFunction("delete_recursive", DeleteFn);
     RegisterFunction("package_extract_dir", PackageExtractDirFn);
     RegisterFunction("package_extract_file", PackageExtractFileFn);
+    RegisterFunction("package_verify_entries", PackageVerifyEntriesFn);
     RegisterFunction("symlink", SymlinkFn);
 
     // Maybe, at some future point, we can delete these functions? They have been
@@ -1545,6 +1681,7 @@ void RegisterInstallFunctions() {
 
     RegisterFunction("apply_patch", ApplyPatchFn);
     RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
+    RegisterFunction("apply_patch_check_all", ApplyPatchCheckAllFn);
     RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
 
     RegisterFunction("read_file", ReadFileFn);
@@ -21,6 +21,7 @@
 #include "edify/expr.h"
 #include "updater.h"
 #include "install.h"
+#include "blockimg.h"
 #include "minzip/Zip.h"
 
 // Generated by the makefile, this function defines the
@@ -92,6 +93,7 @@ int main(int argc, char** argv) {
 
     RegisterBuiltins();
     RegisterInstallFunctions();
+    RegisterBlockImageFunctions();
     RegisterDeviceExtensions();
     FinishRegistration();
 
@@ -121,6 +123,10 @@ int main(int argc, char** argv) {
     UpdaterInfo updater_info;
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
+
+    // Blobs extracted from stored entries point into the package
+    // mapping, which stays open until the script is done.
+    SetBorrowedMemory(za.map.addr, za.map.length);
     updater_info.version = atoi(version);
 
     State state;